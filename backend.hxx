@@ -0,0 +1,442 @@
+#pragma once
+#include <cstddef>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.hxx"
+
+using std::size_t;
+using std::vector;
+using std::string;
+
+enum BackendType {
+    BACKEND_PREAD, // file descriptor with pread/pwrite
+    BACKEND_MMAP   // shared mapping of the whole image
+};
+
+/**
+ * Interface to the storage holding the virtual disk image,
+ * kept open for the life of the mount
+ */
+class DiskBackend {
+public:
+    virtual ~DiskBackend() {}
+
+    /**
+     * Opens an existing image file
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int open(const char* fileName) = 0;
+
+    /**
+     * Creates (or truncates) an image file of the given size filled with zeros
+     * and opens it
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int create(const char* fileName, size_t size) = 0;
+
+    /**
+     * Reads count bytes at the given byte offset of the image into the buffer
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int read(char* buffer, size_t count, size_t offset) = 0;
+
+    /**
+     * Writes count bytes from the buffer at the given byte offset of the image
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int write(const char* buffer, size_t count, size_t offset) = 0;
+
+    /**
+     * Flushes written data to the underlying file
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int sync() = 0;
+
+    /**
+     * Closes the image
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    virtual int close() = 0;
+
+    /**
+     * Returns a pointer to the image contents if the backend maps it in memory
+     * or nullptr otherwise
+     */
+    virtual char* data() { return nullptr; }
+};
+
+class FdBackend : public DiskBackend {
+private:
+    int fd = -1;
+public:
+    ~FdBackend() {
+        close();
+    }
+
+    int open(const char* fileName) override {
+        if (fd != -1) return 1; // already open
+        fd = ::open(fileName, O_RDWR);
+        return fd == -1;
+    }
+
+    int create(const char* fileName, size_t size) override {
+        if (fd != -1) return 1; // already open
+        fd = ::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) return 1;
+        return ftruncate(fd, size) != 0;
+    }
+
+    int read(char* buffer, size_t count, size_t offset) override {
+        STATS_TIME(TIMER_DISK_READ);
+        STATS_COUNT(STAT_DISK_READS, 1);
+        STATS_COUNT(STAT_DISK_READ_BYTES, count);
+        while (count > 0) {
+            ssize_t n = pread(fd, buffer, count, offset);
+            if (n <= 0) return 1; // failed to read or read past the end of the image
+            buffer += n;
+            count -= n;
+            offset += n;
+        }
+        return 0;
+    }
+
+    int write(const char* buffer, size_t count, size_t offset) override {
+        STATS_TIME(TIMER_DISK_WRITE);
+        STATS_COUNT(STAT_DISK_WRITES, 1);
+        STATS_COUNT(STAT_DISK_WRITE_BYTES, count);
+        while (count > 0) {
+            ssize_t n = pwrite(fd, buffer, count, offset);
+            if (n <= 0) return 1; // failed to write
+            buffer += n;
+            count -= n;
+            offset += n;
+        }
+        return 0;
+    }
+
+    int sync() override {
+        if (fd == -1) return 1;
+        STATS_TIME(TIMER_DISK_SYNC);
+        return fdatasync(fd) != 0;
+    }
+
+    int close() override {
+        if (fd == -1) return 1; // not open
+        int result = ::close(fd);
+        fd = -1;
+        return result != 0;
+    }
+};
+
+class MmapBackend : public DiskBackend {
+private:
+    int fd = -1;
+    char* map = nullptr;
+    size_t mapSize = 0;
+
+    int mapFile() {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return 1;
+        mapSize = st.st_size;
+        void* addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) return 1;
+        map = static_cast<char*>(addr);
+        return 0;
+    }
+public:
+    ~MmapBackend() {
+        close();
+    }
+
+    int open(const char* fileName) override {
+        if (fd != -1) return 1; // already open
+        fd = ::open(fileName, O_RDWR);
+        if (fd == -1) return 1;
+        return mapFile();
+    }
+
+    int create(const char* fileName, size_t size) override {
+        if (fd != -1) return 1; // already open
+        fd = ::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) return 1;
+        if (ftruncate(fd, size) != 0) return 1;
+        return mapFile();
+    }
+
+    int read(char* buffer, size_t count, size_t offset) override {
+        if (map == nullptr || offset + count > mapSize) return 1;
+        STATS_TIME(TIMER_DISK_READ);
+        STATS_COUNT(STAT_DISK_READS, 1);
+        STATS_COUNT(STAT_DISK_READ_BYTES, count);
+        memcpy(buffer, map + offset, count);
+        return 0;
+    }
+
+    int write(const char* buffer, size_t count, size_t offset) override {
+        if (map == nullptr || offset + count > mapSize) return 1;
+        STATS_TIME(TIMER_DISK_WRITE);
+        STATS_COUNT(STAT_DISK_WRITES, 1);
+        STATS_COUNT(STAT_DISK_WRITE_BYTES, count);
+        memcpy(map + offset, buffer, count);
+        return 0;
+    }
+
+    int sync() override {
+        if (map == nullptr) return 1;
+        STATS_TIME(TIMER_DISK_SYNC);
+        return msync(map, mapSize, MS_SYNC) != 0;
+    }
+
+    int close() override {
+        if (fd == -1) return 1; // not open
+        if (map != nullptr) munmap(map, mapSize);
+        map = nullptr;
+        mapSize = 0;
+        int result = ::close(fd);
+        fd = -1;
+        return result != 0;
+    }
+
+    char* data() override {
+        return map;
+    }
+};
+
+/**
+ * Volume striped over several images, each on a backend of its own,
+ * with stripes of stripeSize bytes laid out round-robin: stripe s
+ * of the volume is stripe s / N of image s % N
+ *
+ * A request spanning several images is split into one part per image
+ * run in parallel on the I/O worker thread of each image, but for the part
+ * of its first image, which the calling thread runs meanwhile
+ */
+class StripedBackend : public DiskBackend {
+private:
+    typedef struct segment_t {
+        char* buffer;
+        size_t count;
+        size_t offset; // in the image
+    } segment;
+
+    typedef struct image_t {
+        string path;
+        std::unique_ptr<DiskBackend> disk;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+    } image;
+
+    typedef struct batch_t {
+        std::mutex lock;
+        std::condition_variable done;
+        int remaining = 0; // parts still running on workers
+        int result = 0;
+    } batch;
+
+    vector<std::unique_ptr<image>> images;
+    size_t stripeSize;
+
+    static void work(image& img) {
+        std::unique_lock<std::mutex> guard(img.lock);
+        while (true) {
+            img.wake.wait(guard, [&]() { return img.stopping || !img.tasks.empty(); });
+            if (img.tasks.empty()) return; // stopping with nothing left to run
+            std::function<void()> task = std::move(img.tasks.front());
+            img.tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+
+    void startWorkers() {
+        for (auto& img : images) {
+            img->stopping = false;
+            img->worker = std::thread(work, std::ref(*img));
+        }
+    }
+
+    void stopWorkers() {
+        for (auto& img : images) {
+            if (!img->worker.joinable()) continue;
+            {
+                std::lock_guard<std::mutex> guard(img->lock);
+                img->stopping = true;
+            }
+            img->wake.notify_one();
+            img->worker.join();
+        }
+    }
+
+    /**
+     * Runs op on each of the targeted images, on their workers but for the first
+     * one run by the calling thread, and waits for all of them
+     *
+     * Returns 0 on success and 1 on failure of any of them
+     */
+    int fanOut(const vector<int>& targets, const std::function<int(int)>& op) {
+        batch parts;
+        parts.remaining = targets.size() - 1;
+        for (size_t t = 1; t < targets.size(); t++) {
+            image& img = *images[targets[t]];
+            int i = targets[t];
+            {
+                std::lock_guard<std::mutex> guard(img.lock);
+                img.tasks.push_back([&parts, &op, i]() {
+                    int result = op(i);
+                    std::lock_guard<std::mutex> guard(parts.lock);
+                    parts.result |= result;
+                    if (--parts.remaining == 0) parts.done.notify_one();
+                });
+            }
+            img.wake.notify_one();
+        }
+        int result = op(targets[0]);
+        std::unique_lock<std::mutex> guard(parts.lock);
+        parts.done.wait(guard, [&]() { return parts.remaining == 0; });
+        return result | parts.result;
+    }
+
+    /**
+     * Splits count bytes at the given offset of the volume into segments
+     * of each image
+     *
+     * Returns the images holding some of the bytes, the one of the first byte first
+     */
+    vector<int> split(char* buffer, size_t count, size_t offset, vector<vector<segment>>& segments) {
+        vector<int> targets;
+        segments.resize(images.size());
+        while (count > 0) {
+            size_t stripe = offset / stripeSize, inStripe = offset % stripeSize;
+            size_t bytes = std::min(count, stripeSize - inStripe);
+            int i = stripe % images.size();
+            if (segments[i].empty()) targets.push_back(i);
+            segments[i].push_back(segment {buffer, bytes, stripe / images.size() * stripeSize + inStripe});
+            buffer += bytes;
+            count -= bytes;
+            offset += bytes;
+        }
+        return targets;
+    }
+
+    /**
+     * Reads or writes count bytes at the given offset of the volume
+     * calling the read or write of each image on its segments in parallel
+     */
+    template <typename F>
+    int transfer(char* buffer, size_t count, size_t offset, F io) {
+        if (count == 0) return 0;
+        size_t stripe = offset / stripeSize;
+        if (stripe == (offset + count - 1) / stripeSize) { // within a single stripe
+            return io(*images[stripe % images.size()]->disk, buffer, count, stripe / images.size() * stripeSize + offset % stripeSize);
+        }
+        vector<vector<segment>> segments;
+        vector<int> targets = split(buffer, count, offset, segments);
+        return fanOut(targets, [&](int i) {
+            for (segment& part : segments[i]) {
+                if (io(*images[i]->disk, part.buffer, part.count, part.offset) != 0) return 1;
+            }
+            return 0;
+        });
+    }
+
+    vector<int> allImages() const {
+        vector<int> targets(images.size());
+        for (size_t i = 0; i < images.size(); i++) targets[i] = i;
+        return targets;
+    }
+public:
+    /**
+     * Stripes a volume over the given images of the given paths
+     */
+    StripedBackend(vector<std::unique_ptr<DiskBackend>> disks, const vector<string>& paths, size_t stripeSize) : stripeSize(stripeSize) {
+        for (size_t i = 0; i < disks.size(); i++) {
+            images.emplace_back(new image());
+            images.back()->path = paths[i];
+            images.back()->disk = std::move(disks[i]);
+        }
+    }
+
+    ~StripedBackend() {
+        close();
+    }
+
+    /**
+     * Opens every image (the file name being the path of the first one)
+     */
+    int open(const char* fileName) override {
+        if (images.empty() || images[0]->path != fileName || images[0]->worker.joinable()) return 1; // not the first image or already open
+        for (size_t i = 0; i < images.size(); i++) {
+            if (images[i]->disk->open(images[i]->path.c_str()) != 0) {
+                for (size_t j = 0; j < i; j++) images[j]->disk->close();
+                return 1; // failed to open image
+            }
+        }
+        startWorkers();
+        return 0;
+    }
+
+    /**
+     * Creates every image (the file name being the path of the first one)
+     * with room for its stripes of a volume of the given size
+     */
+    int create(const char* fileName, size_t size) override {
+        if (images.empty() || images[0]->path != fileName || images[0]->worker.joinable()) return 1; // not the first image or already open
+        size_t stripes = (size + stripeSize - 1) / stripeSize;
+        size_t imageSize = (stripes + images.size() - 1) / images.size() * stripeSize;
+        for (size_t i = 0; i < images.size(); i++) {
+            if (images[i]->disk->create(images[i]->path.c_str(), imageSize) != 0) {
+                for (size_t j = 0; j < i; j++) images[j]->disk->close();
+                return 1; // failed to create image
+            }
+        }
+        startWorkers();
+        return 0;
+    }
+
+    int read(char* buffer, size_t count, size_t offset) override {
+        return transfer(buffer, count, offset, [](DiskBackend& disk, char* part, size_t bytes, size_t at) {
+            return disk.read(part, bytes, at);
+        });
+    }
+
+    int write(const char* buffer, size_t count, size_t offset) override {
+        return transfer(const_cast<char*>(buffer), count, offset, [](DiskBackend& disk, char* part, size_t bytes, size_t at) {
+            return disk.write(part, bytes, at);
+        });
+    }
+
+    int sync() override {
+        if (images.empty() || !images[0]->worker.joinable()) return 1; // not open
+        return fanOut(allImages(), [&](int i) { return images[i]->disk->sync(); });
+    }
+
+    int close() override {
+        if (images.empty() || !images[0]->worker.joinable()) return 1; // not open
+        stopWorkers();
+        int result = 0;
+        for (auto& img : images) result |= img->disk->close();
+        return result;
+    }
+};
@@ -0,0 +1,564 @@
+#include "fs.hxx"
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+
+using std::chrono::steady_clock;
+
+#define BENCH_NUM_BLOCKS 65536 // image size in blocks at scale 1
+#define BENCH_NUM_INODES 16384 // number of inodes at scale 1
+#define BENCH_SEED 42 // seed of every random offset sequence
+
+typedef struct benchConfig_t {
+    BackendType backend = BACKEND_PREAD;
+    size_t cacheBlocks = CACHE_BLOCKS;
+    vector<string> images = {VDISK_FILE_NAME}; // image files the blocks are striped over
+    int stripeBlocks = STRIPE_BLOCKS;
+    double scale = 1; // multiplies the amount of work of every benchmark
+    string only; // runs only the benchmarks whose name starts with it
+} benchConfig;
+
+/**
+ * Returns the microseconds elapsed since the given time point
+ */
+double elapsedMicros(steady_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(steady_clock::now() - start).count();
+}
+
+/**
+ * Latencies of the operations of one benchmark
+ * reported as a JSON object with the throughput and latency percentiles
+ */
+class Recorder {
+private:
+    string name;
+    size_t ioSize;
+    vector<double> latencies; // microseconds
+    vector<std::pair<string, double>> fields; // reported along with the results
+public:
+    Recorder(const string& name, size_t ioSize = 0) : name(name), ioSize(ioSize) {}
+
+    /**
+     * Runs and times one operation
+     *
+     * Returns the result of the operation
+     */
+    template <typename F>
+    int time(F op) {
+        steady_clock::time_point start = steady_clock::now();
+        int result = op();
+        latencies.push_back(elapsedMicros(start));
+        return result;
+    }
+
+    /**
+     * Adds the latencies timed by another recorder (of another thread)
+     */
+    void merge(const Recorder& other) {
+        latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+    }
+
+    /**
+     * Reports a value measured by the benchmark along with the results
+     */
+    void report(const string& key, double value) {
+        fields.emplace_back(key, value);
+    }
+
+    /**
+     * Returns the JSON object of the results
+     */
+    string json() {
+        vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double latency : sorted) total += latency;
+        auto percentile = [&](double p) {
+            if (sorted.empty()) return 0.0;
+            return sorted[std::min(sorted.size() - 1, (size_t) (p / 100 * sorted.size()))];
+        };
+        double seconds = total / 1e6;
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"name\": \"" << name << "\", \"io_size\": " << ioSize << ", \"ops\": " << sorted.size()
+            << ", \"seconds\": " << seconds << ", \"ops_per_sec\": " << (seconds > 0 ? sorted.size() / seconds : 0);
+        if (ioSize > 0) out << ", \"mb_per_sec\": " << (seconds > 0 ? sorted.size() * ioSize / seconds / (1 << 20) : 0);
+        for (auto& field : fields) out << ", \"" << field.first << "\": " << field.second;
+        out << ", \"latency_us\": {\"p50\": " << percentile(50) << ", \"p90\": " << percentile(90) << ", \"p99\": " << percentile(99)
+            << ", \"p999\": " << percentile(99.9) << ", \"max\": " << (sorted.empty() ? 0 : sorted.back()) << "}}";
+        return out.str();
+    }
+};
+
+/**
+ * Runs the benchmarks selected by the configuration on fresh images
+ * collecting the JSON object of every result
+ */
+class Bench {
+private:
+    benchConfig config;
+    vector<string> results;
+    vector<char> data;
+
+    size_t scaled(size_t count) const {
+        return std::max((size_t) 1, (size_t) (count * config.scale));
+    }
+
+    bool selected(const string& name) const {
+        return name.compare(0, config.only.size(), config.only) == 0;
+    }
+
+    /**
+     * Formats a new image large enough for the scaled benchmarks and mounts it
+     */
+    std::unique_ptr<FileSystem> freshFileSystem() {
+        for (const string& image : config.images) std::filesystem::remove(image);
+        double factor = std::max(1.0, config.scale);
+        return std::unique_ptr<FileSystem>(new FileSystem(config.backend, config.cacheBlocks,
+            (long long) (BENCH_NUM_BLOCKS * factor), (long long) (BENCH_NUM_INODES * factor), config.images, config.stripeBlocks));
+    }
+
+    /**
+     * Creates a file filled with size bytes written in 1 MB writes
+     *
+     * Returns the file descriptor or -1 on failure
+     */
+    int filledFile(FileSystem& fs, string path, size_t size) {
+        int fd = fs.open(path);
+        if (fd == -1) return -1;
+        for (size_t offset = 0; offset < size; offset += 1 << 20) {
+            if (fs.write(fd, data.data(), std::min((size_t) 1 << 20, size - offset)) != 0) return -1;
+        }
+        if (fs.sync() != 0) return -1;
+        return fd;
+    }
+
+    /**
+     * Writes then reads a file sequentially with the given I/O size
+     */
+    int sequential(size_t ioSize) {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t ops = scaled((64 << 20) / ioSize);
+        string path = "/seq";
+        int fd = fs->open(path);
+        if (fd == -1) return 1;
+        Recorder writes("seq_write", ioSize), reads("seq_read", ioSize);
+        for (size_t i = 0; i < ops; i++) {
+            if (writes.time([&]() { return fs->write(fd, data.data(), ioSize); }) != 0) return 1;
+        }
+        if (fs->sync() != 0) return 1;
+        for (size_t i = 0; i < ops; i++) {
+            if (reads.time([&]() { return fs->read(fd, data.data(), ioSize); }) != 0) return 1;
+        }
+        results.push_back(writes.json());
+        results.push_back(reads.json());
+        return fs->close(fd);
+    }
+
+    /**
+     * Writes then reads blocks of a file at random aligned offsets with the given I/O size
+     */
+    int random(size_t ioSize) {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t fileSize = scaled(64 << 20) / ioSize * ioSize;
+        int fd = filledFile(*fs, "/rand", fileSize);
+        if (fd == -1) return 1;
+        std::mt19937_64 rng(BENCH_SEED);
+        std::uniform_int_distribution<size_t> slot(0, fileSize / ioSize - 1);
+        size_t ops = scaled(4096);
+        Recorder writes("rand_write", ioSize), reads("rand_read", ioSize);
+        for (size_t i = 0; i < ops; i++) {
+            size_t offset = slot(rng) * ioSize;
+            if (writes.time([&]() { return fs->pwrite(fd, data.data(), ioSize, offset); }) != 0) return 1;
+        }
+        if (fs->sync() != 0) return 1;
+        for (size_t i = 0; i < ops; i++) {
+            size_t offset = slot(rng) * ioSize;
+            if (reads.time([&]() { return fs->pread(fd, data.data(), ioSize, offset); }) != 0) return 1;
+        }
+        results.push_back(writes.json());
+        results.push_back(reads.json());
+        return fs->close(fd);
+    }
+
+    /**
+     * Creates many small files (open, one write and close each) then removes them
+     */
+    int smallFiles() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t count = scaled(5000);
+        string path = "/storm";
+        if (fs->mkdir(path) != 0) return 1;
+        Recorder creates("small_create", 1024), removes("small_remove");
+        for (size_t i = 0; i < count; i++) {
+            path = "/storm/file" + std::to_string(i);
+            int result = creates.time([&]() {
+                int fd = fs->open(path);
+                if (fd == -1) return 1;
+                if (fs->write(fd, data.data(), 1024) != 0) return 1;
+                return fs->close(fd);
+            });
+            if (result != 0) return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            path = "/storm/file" + std::to_string(i);
+            if (removes.time([&]() { return fs->remove(path); }) != 0) return 1;
+        }
+        results.push_back(creates.json());
+        results.push_back(removes.json());
+        return 0;
+    }
+
+    /**
+     * Opens and closes a file at the bottom of a deep directory tree
+     */
+    int deepLookup() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        string path;
+        for (int depth = 0; depth < 16; depth++) {
+            path += "/level" + std::to_string(depth);
+            string dir = path;
+            if (fs->mkdir(dir) != 0) return 1;
+        }
+        string leaf = path + "/leaf";
+        path = leaf;
+        int fd = fs->open(path);
+        if (fd == -1 || fs->close(fd) != 0) return 1;
+        Recorder lookups("deep_lookup");
+        size_t ops = scaled(20000);
+        for (size_t i = 0; i < ops; i++) {
+            path = leaf;
+            int result = lookups.time([&]() {
+                int fd = fs->open(path);
+                if (fd == -1) return 1;
+                return fs->close(fd);
+            });
+            if (result != 0) return 1;
+        }
+        results.push_back(lookups.json());
+        return 0;
+    }
+
+    /**
+     * Fills a directory then looks up and lists its entries
+     */
+    int directoryFill() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t count = scaled(10000);
+        string path = "/fill";
+        if (fs->mkdir(path) != 0) return 1;
+        Recorder creates("dir_create"), lookups("dir_lookup"), listings("dir_readdir");
+        for (int pass = 0; pass < 2; pass++) {
+            Recorder& recorder = pass == 0 ? creates : lookups;
+            for (size_t i = 0; i < count; i++) {
+                path = "/fill/entry" + std::to_string(i);
+                int result = recorder.time([&]() {
+                    int fd = fs->open(path);
+                    if (fd == -1) return 1;
+                    return fs->close(fd);
+                });
+                if (result != 0) return 1;
+            }
+        }
+        size_t cookie = 0, listed = 0;
+        vector<dirEntry> entries;
+        do {
+            path = "/fill";
+            if (listings.time([&]() { return fs->readdir(path, cookie, entries, 64); }) != 0) return 1;
+            listed += entries.size();
+        } while (!entries.empty());
+        if (listed != count) return 1;
+        results.push_back(creates.json());
+        results.push_back(lookups.json());
+        results.push_back(listings.json());
+        return 0;
+    }
+
+    /**
+     * Removes large files reaching the double indirect blocks
+     */
+    int largeRemove() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t count = 4;
+        Recorder removes("large_remove");
+        for (size_t i = 0; i < count; i++) {
+            int fd = filledFile(*fs, "/large" + std::to_string(i), scaled(32 << 20));
+            if (fd == -1 || fs->close(fd) != 0) return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            string path = "/large" + std::to_string(i);
+            if (removes.time([&]() { return fs->remove(path); }) != 0) return 1;
+        }
+        results.push_back(removes.json());
+        return 0;
+    }
+
+    /**
+     * Clones large files, writes at random offsets of the clones
+     * (copying the shared blocks) then removes the clones
+     */
+    int cloneFiles() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t count = 4, fileSize = scaled(32 << 20) / 4096 * 4096;
+        Recorder clones("clone"), writes("clone_cow_write", 4096), removes("clone_remove");
+        for (size_t i = 0; i < count; i++) {
+            int fd = filledFile(*fs, "/source" + std::to_string(i), fileSize);
+            if (fd == -1 || fs->close(fd) != 0) return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            string source = "/source" + std::to_string(i), copy = "/copy" + std::to_string(i);
+            if (clones.time([&]() { return fs->clone(source, copy); }) != 0) return 1;
+        }
+        std::mt19937_64 rng(BENCH_SEED);
+        std::uniform_int_distribution<size_t> slot(0, fileSize / 4096 - 1);
+        for (size_t i = 0; i < count; i++) {
+            string copy = "/copy" + std::to_string(i);
+            int fd = fs->open(copy);
+            if (fd == -1) return 1;
+            for (size_t op = 0; op < scaled(1024); op++) {
+                size_t offset = slot(rng) * 4096;
+                if (writes.time([&]() { return fs->pwrite(fd, data.data(), 4096, offset); }) != 0) return 1;
+            }
+            if (fs->close(fd) != 0) return 1;
+        }
+        if (fs->sync() != 0) return 1;
+        for (size_t i = 0; i < count; i++) {
+            string copy = "/copy" + std::to_string(i);
+            if (removes.time([&]() { return fs->remove(copy); }) != 0) return 1;
+        }
+        results.push_back(clones.json());
+        results.push_back(writes.json());
+        results.push_back(removes.json());
+        return 0;
+    }
+
+    /**
+     * Scans a file sequentially in 1 MB reads parsing the data (summing its words)
+     * copied into a buffer by pread then in place through read views
+     */
+    int scan() {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t ioSize = 1 << 20, fileSize = scaled(64 << 20) / ioSize * ioSize;
+        int fd = filledFile(*fs, "/scan", fileSize);
+        if (fd == -1) return 1;
+        vector<char> buffer(ioSize);
+        uint64_t sums[2] = {0, 0};
+        auto parse = [](const char* bytes, size_t count) {
+            uint64_t sum = 0, word;
+            for (size_t i = 0; i + sizeof(word) <= count; i += sizeof(word)) {
+                memcpy(&word, bytes + i, sizeof(word));
+                sum += word;
+            }
+            return sum;
+        };
+        Recorder reads("scan_read", ioSize), views("scan_view", ioSize);
+        for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+            int result = reads.time([&]() {
+                if (fs->pread(fd, buffer.data(), ioSize, offset) != 0) return 1;
+                sums[0] += parse(buffer.data(), ioSize);
+                return 0;
+            });
+            if (result != 0) return 1;
+        }
+        vector<readView> spans;
+        for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+            int result = views.time([&]() {
+                int viewHandle = fs->readViews(fd, ioSize, offset, spans);
+                if (viewHandle == -1) return 1;
+                for (readView& span : spans) sums[1] += parse(span.data, span.size); // runs are whole blocks of 8-byte words
+                return fs->releaseViews(viewHandle);
+            });
+            if (result != 0) return 1;
+        }
+        if (sums[0] != sums[1]) return 1; // views differ from the data read
+        results.push_back(reads.json());
+        results.push_back(views.json());
+        return fs->close(fd);
+    }
+
+    /**
+     * Writes then reads a compressed file sequentially in 64 KB I/Os,
+     * filled with log lines if text is true and with random bytes otherwise,
+     * reporting the ratio of the bytes written to the bytes stored
+     */
+    int compressed(bool text) {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t ioSize = 65536, ops = scaled((64 << 20) / ioSize);
+        vector<char> buffer(ioSize);
+        std::mt19937_64 rng(BENCH_SEED);
+        string log;
+        while (text && log.size() < (16 << 20)) { // lines repeating their fields with varying values
+            log += "2024-03-0" + std::to_string(1 + rng() % 9) + " 12:" + std::to_string(10 + rng() % 50) + ":" + std::to_string(10 + rng() % 50)
+                + " INFO worker-" + std::to_string(rng() % 8) + " request " + std::to_string(rng() % 100000)
+                + (rng() % 4 == 0 ? " failed: connection reset by peer\n" : " served in " + std::to_string(rng() % 500) + " ms\n");
+        }
+        string path = "/compressed";
+        int fd = fs->open(path);
+        if (fd == -1 || fs->setCompression(fd, true) != 0) return 1;
+        string kind = text ? "text" : "random";
+        Recorder writes("compress_write_" + kind, ioSize), reads("compress_read_" + kind, ioSize);
+        statsSnapshot before = Stats::snapshot();
+        for (size_t i = 0; i < ops; i++) {
+            const char* source = text ? log.data() + i * ioSize % (log.size() - ioSize) : data.data() + i * ioSize % data.size();
+            memcpy(buffer.data(), source, ioSize);
+            if (writes.time([&]() { return fs->write(fd, buffer.data(), ioSize); }) != 0) return 1;
+        }
+        if (fs->sync() != 0) return 1;
+        statsSnapshot after = Stats::snapshot();
+        for (size_t i = 0; i < ops; i++) {
+            if (reads.time([&]() { return fs->read(fd, buffer.data(), ioSize); }) != 0) return 1;
+        }
+        uint64_t bytesIn = after.counters[STAT_COMPRESS_BYTES_IN] - before.counters[STAT_COMPRESS_BYTES_IN];
+        uint64_t bytesOut = after.counters[STAT_COMPRESS_BYTES_OUT] - before.counters[STAT_COMPRESS_BYTES_OUT];
+        writes.report("compression_ratio", bytesOut > 0 ? (double) bytesIn / bytesOut : 0); // 0 if compiled with FS_NO_STATS
+        results.push_back(writes.json());
+        results.push_back(reads.json());
+        return fs->close(fd);
+    }
+
+    /**
+     * Creates files of 1 MB written in 64 KB writes from the given number
+     * of threads at once (the same total for every number of threads),
+     * reporting the aggregate throughput, its speedup over the single thread
+     * baseline (set by the first run) and the contiguous extents per file
+     */
+    int parallel(int threads, double& baseline) {
+        std::unique_ptr<FileSystem> fs = freshFileSystem();
+        size_t ioSize = 65536, fileSize = 1 << 20;
+        int filesPerThread = std::max((size_t) 1, scaled(128) / threads);
+        vector<Recorder> recorders(threads, Recorder("parallel_write", ioSize));
+        std::atomic<int> failures(0);
+        vector<std::thread> writers;
+        steady_clock::time_point start = steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            writers.emplace_back([&, t]() {
+                for (int f = 0; f < filesPerThread; f++) {
+                    string path = "/par" + std::to_string(t) + "_" + std::to_string(f);
+                    int fd = fs->open(path);
+                    if (fd == -1) {
+                        failures++;
+                        return;
+                    }
+                    for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+                        char* source = data.data() + (t * fileSize + offset) % data.size();
+                        if (recorders[t].time([&]() { return fs->write(fd, source, ioSize); }) != 0) failures++;
+                    }
+                    if (fs->close(fd) != 0) failures++;
+                }
+            });
+        }
+        for (std::thread& writer : writers) writer.join();
+        double seconds = elapsedMicros(start) / 1e6;
+        if (failures > 0) return 1;
+        // every contiguous run of blocks of a file is a view of its own
+        size_t extents = 0;
+        vector<readView> views;
+        for (int t = 0; t < threads; t++) {
+            for (int f = 0; f < filesPerThread; f++) {
+                string path = "/par" + std::to_string(t) + "_" + std::to_string(f);
+                int fd = fs->open(path);
+                if (fd == -1) return 1;
+                int viewHandle = fs->readViews(fd, fileSize, 0, views);
+                if (viewHandle == -1 || fs->releaseViews(viewHandle) != 0 || fs->close(fd) != 0) return 1;
+                extents += views.size();
+            }
+        }
+        Recorder writes("parallel_write", ioSize);
+        for (Recorder& recorder : recorders) writes.merge(recorder);
+        double throughput = (double) threads * filesPerThread * fileSize / seconds / (1 << 20);
+        if (baseline == 0) baseline = throughput;
+        writes.report("threads", threads);
+        writes.report("aggregate_mb_per_sec", throughput);
+        writes.report("speedup", throughput / baseline);
+        writes.report("extents_per_file", (double) extents / (threads * filesPerThread));
+        results.push_back(writes.json());
+        return 0;
+    }
+
+    /**
+     * Runs a benchmark if it is selected
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    template <typename F>
+    int run(const string& name, F benchmark) {
+        if (!selected(name)) return 0;
+        if (benchmark() == 0) return 0;
+        std::cerr << "benchmark " << name << " failed\n";
+        return 1;
+    }
+public:
+    Bench(const benchConfig& config) : config(config), data(1 << 20) {
+        std::mt19937_64 rng(BENCH_SEED);
+        for (char& c : data) c = (char) rng();
+    }
+
+    /**
+     * Runs every selected benchmark and prints the results as JSON
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int runAll() {
+        int result = 0;
+        for (size_t ioSize : {(size_t) 4096, (size_t) 65536, (size_t) 1 << 20}) {
+            result |= run("seq", [&]() { return sequential(ioSize); });
+        }
+        for (size_t ioSize : {(size_t) 4096, (size_t) 65536}) {
+            result |= run("rand", [&]() { return random(ioSize); });
+        }
+        result |= run("small", [&]() { return smallFiles(); });
+        result |= run("deep", [&]() { return deepLookup(); });
+        result |= run("dir", [&]() { return directoryFill(); });
+        result |= run("large", [&]() { return largeRemove(); });
+        result |= run("clone", [&]() { return cloneFiles(); });
+        result |= run("scan", [&]() { return scan(); });
+        for (bool text : {true, false}) {
+            result |= run("compress", [&]() { return compressed(text); });
+        }
+        double baseline = 0;
+        for (int threads : {1, 2, 4, 8}) {
+            result |= run("parallel", [&]() { return parallel(threads, baseline); });
+        }
+        for (const string& image : config.images) std::filesystem::remove(image);
+        cout << "{\n  \"config\": {\"backend\": \"" << (config.backend == BACKEND_MMAP ? "mmap" : "pread")
+             << "\", \"cache_blocks\": " << config.cacheBlocks << ", \"scale\": " << config.scale
+             << ", \"images\": " << config.images.size() << ", \"stripe_blocks\": " << (config.images.size() > 1 ? config.stripeBlocks : 0)
+             << ", \"block_size\": " << DefaultGeometry::BLOCK_SIZE << "},\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++) cout << (i == 0 ? "\n    " : ",\n    ") << results[i];
+        cout << "\n  ],\n  \"stats\": ";
+        Stats::snapshot().print(cout);
+        cout << "}\n";
+        return result;
+    }
+};
+
+int main(int argc, char** argv) {
+    benchConfig config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "usage: bench [--backend pread|mmap] [--cache blocks] [--scale factor] [--only prefix]\n"
+                      << "             [--images path,path,...] [--stripe blocks]\n";
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--backend") config.backend = value == "mmap" ? BACKEND_MMAP : BACKEND_PREAD;
+        else if (arg == "--cache") config.cacheBlocks = std::stoul(value);
+        else if (arg == "--scale") config.scale = std::stod(value);
+        else if (arg == "--only") config.only = value;
+        else if (arg == "--images") {
+            config.images.clear();
+            std::stringstream paths(value);
+            for (string path; std::getline(paths, path, ',');) config.images.push_back(path);
+        }
+        else if (arg == "--stripe") config.stripeBlocks = std::stoi(value);
+        else {
+            std::cerr << "unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+    Bench bench(config);
+    return bench.runAll();
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+using std::size_t;
+
+/**
+ * Bit vector packed in 64-bit words where a set bit marks a free entry
+ */
+class Bitmap {
+private:
+    vector<uint64_t> words;
+    size_t numBits = 0;
+    size_t numSet = 0;
+
+    static uint64_t mask(size_t from, size_t to) { // bits [from, to) of a word
+        uint64_t high = to == 64 ? ~0ULL : (1ULL << to) - 1;
+        return high & ~((1ULL << from) - 1);
+    }
+
+    /**
+     * Applies an operation to every word overlapping the range [start, start + count)
+     * with the mask of the bits inside the range
+     */
+    template <typename F>
+    void forRange(size_t start, size_t count, F op) {
+        size_t end = start + count;
+        while (start < end) {
+            size_t w = start / 64;
+            size_t to = std::min(end - w * 64, (size_t) 64);
+            op(words[w], mask(start % 64, to));
+            start = w * 64 + to;
+        }
+    }
+public:
+    Bitmap(size_t numBits = 0) {
+        resize(numBits);
+    }
+
+    /**
+     * Resizes the bitmap to the given number of bits all cleared
+     */
+    void resize(size_t bits) {
+        numBits = bits;
+        numSet = 0;
+        words.assign((bits + 63) / 64, 0);
+    }
+
+    size_t size() const {
+        return numBits;
+    }
+
+    /**
+     * Returns the number of set bits
+     */
+    size_t count() const {
+        return numSet;
+    }
+
+    bool test(size_t i) const {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    void set(size_t i) {
+        if (!test(i)) numSet++;
+        words[i / 64] |= 1ULL << (i % 64);
+    }
+
+    void clear(size_t i) {
+        if (test(i)) numSet--;
+        words[i / 64] &= ~(1ULL << (i % 64));
+    }
+
+    /**
+     * Returns true if every bit in [start, start + count) is set (or cleared if value is false)
+     */
+    bool testRange(size_t start, size_t count, bool value) {
+        bool result = true;
+        forRange(start, count, [&](uint64_t& word, uint64_t m) {
+            if ((word & m) != (value ? m : 0)) result = false;
+        });
+        return result;
+    }
+
+    /**
+     * Returns the number of set bits in [start, start + count)
+     */
+    size_t countRange(size_t start, size_t count) {
+        size_t result = 0;
+        forRange(start, count, [&](uint64_t& word, uint64_t m) {
+            result += __builtin_popcountll(word & m);
+        });
+        return result;
+    }
+
+    /**
+     * Sets every bit in [start, start + count)
+     */
+    void setRange(size_t start, size_t count) {
+        forRange(start, count, [&](uint64_t& word, uint64_t m) {
+            numSet += __builtin_popcountll(~word & m);
+            word |= m;
+        });
+    }
+
+    /**
+     * Clears every bit in [start, start + count)
+     */
+    void clearRange(size_t start, size_t count) {
+        forRange(start, count, [&](uint64_t& word, uint64_t m) {
+            numSet -= __builtin_popcountll(word & m);
+            word &= ~m;
+        });
+    }
+
+    /**
+     * Returns the index of the first set bit in [from, to) or -1 if there is none
+     */
+    long findSet(size_t from, size_t to) const {
+        if (from >= to) return -1;
+        size_t w = from / 64;
+        uint64_t word = words[w] & ~((1ULL << (from % 64)) - 1);
+        while (true) {
+            if (word != 0) {
+                size_t i = w * 64 + __builtin_ctzll(word);
+                return i < to ? (long) i : -1;
+            }
+            if (++w * 64 >= to) return -1;
+            word = words[w];
+        }
+    }
+
+    /**
+     * Returns the index of the first cleared bit in [from, to) or -1 if there is none
+     */
+    long findClear(size_t from, size_t to) const {
+        if (from >= to) return -1;
+        size_t w = from / 64;
+        uint64_t word = ~words[w] & ~((1ULL << (from % 64)) - 1);
+        while (true) {
+            if (word != 0) {
+                size_t i = w * 64 + __builtin_ctzll(word);
+                return i < to ? (long) i : -1;
+            }
+            if (++w * 64 >= to) return -1;
+            word = ~words[w];
+        }
+    }
+
+    /**
+     * Loads the bitmap from bytes storing bits most significant first
+     * (the on-disk freeblock format)
+     */
+    void loadBytes(const unsigned char* bytes) {
+        numSet = 0;
+        for (size_t w = 0; w < words.size(); w++) {
+            uint64_t word = 0;
+            for (size_t b = 0; b < 8 && w * 8 + b < (numBits + 7) / 8; b++)
+                word |= (uint64_t) reverse(bytes[w * 8 + b]) << (8 * b);
+            if (w == words.size() - 1 && numBits % 64 != 0) word &= mask(0, numBits % 64);
+            words[w] = word;
+            numSet += __builtin_popcountll(word);
+        }
+    }
+
+    /**
+     * Stores the bitmap into bytes storing bits most significant first
+     * (the on-disk freeblock format)
+     */
+    void storeBytes(unsigned char* bytes) const {
+        storeBytes(bytes, 0, (numBits + 7) / 8);
+    }
+
+    /**
+     * Stores count bytes of the on-disk format starting from byte firstByte
+     * (bytes past the end of the bitmap are zero)
+     */
+    void storeBytes(unsigned char* bytes, size_t firstByte, size_t count) const {
+        for (size_t i = 0; i < count; i++) {
+            size_t b = firstByte + i;
+            bytes[i] = b < (numBits + 7) / 8 ? reverse((words[b / 8] >> (8 * (b % 8))) & 0xff) : 0;
+        }
+    }
+
+    static unsigned char reverse(unsigned char b) {
+        b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+        b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+        b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+        return b;
+    }
+};
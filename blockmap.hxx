@@ -0,0 +1,368 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <mutex>
+#include "vdd.hxx"
+
+using std::unordered_map;
+
+/**
+ * Logical to physical block map of an open file
+ * which keeps the file's indirect blocks in memory once read
+ * and writes each modified indirect block back once per flush
+ *
+ * Blocks past the direct blocks are reached through trees of
+ * indirect blocks of height 1 (single), 2 (double) and 3 (triple)
+ *
+ * A pointer of -1 is a hole and a block reserved but never written
+ * is stored as the complement of its block number (block 0 is never a data block),
+ * both reading as zeros
+ *
+ * Indirect blocks may be shared with cloned files: a shared indirect block
+ * is copied before it changes, the copy adding a reference to every block it points to
+ */
+template <typename G>
+class BlockMap {
+private:
+    typedef typename G::inode inode;
+    typedef typename G::indirectBlock indirectBlock;
+    typedef typename G::blockPtr blockPtr;
+    static constexpr int NUM_DIRECT = G::NUM_DIRECT;
+    static constexpr int NUM_POINTERS = G::NUM_POINTERS;
+    static constexpr int MAX_FILE_BLOCKS = G::MAX_FILE_BLOCKS;
+
+    typedef struct mappedIndirect_t {
+        bool loaded = false;
+        bool dirty = false;
+        bool owned = false; // known not to be shared with other files
+        int blockNum = -1;
+        indirectBlock block;
+    } mappedIndirect;
+
+    VDiskDriver<G>* driver = nullptr;
+    inode* fileInode = nullptr;
+    unordered_map<uint64_t, mappedIndirect> indirects; // keyed by tree height, depth and the indexes they cover
+    std::mutex mapLock; // concurrent readers may load indirect blocks
+
+    static uint64_t key(int height, int depth, uint64_t prefix) {
+        return (uint64_t) height << 60 | (uint64_t) depth << 56 | prefix;
+    }
+
+    /**
+     * Finds the tree holding the block at the given index in the file
+     * and the index of the block within the tree
+     *
+     * Returns the height of the tree or 0 for a direct block
+     */
+    static int locate(int index, uint64_t& relative) {
+        relative = index;
+        if (relative < (uint64_t) NUM_DIRECT) return 0;
+        relative -= NUM_DIRECT;
+        uint64_t span = NUM_POINTERS;
+        for (int height = 1; ; height++, span *= NUM_POINTERS) {
+            if (relative < span) return height;
+            relative -= span;
+        }
+    }
+
+    /**
+     * Returns the indirect block at the given depth of a tree on the path
+     * to the given block, loading it unless it is already mapped
+     * (an unallocated indirect block maps to all -1 pointers)
+     *
+     * Returns nullptr on failure
+     */
+    mappedIndirect* load(int height, int depth, uint64_t relative, int blockNum) {
+        uint64_t covered = 1;
+        for (int i = depth; i < height; i++) covered *= NUM_POINTERS;
+        mappedIndirect& mapped = indirects[key(height, depth, relative / covered)];
+        if (mapped.loaded) return &mapped;
+        if (blockNum != -1) {
+            STATS_COUNT(STAT_INDIRECT_READS, 1);
+            if (driver->readBlock(reinterpret_cast<char*>(&mapped.block), blockNum) != 0) return nullptr; // failed to read indirect block
+        }
+        mapped.loaded = true;
+        mapped.blockNum = blockNum;
+        return &mapped;
+    }
+
+    /**
+     * Forgets the mapped indirect blocks of the subtree below the indirect block
+     * at the given depth of a tree covering the blocks from base (without writing them back)
+     */
+    void forget(int height, int depth, uint64_t base) {
+        uint64_t span = 1;
+        for (int i = depth; i < height; i++) span *= NUM_POINTERS;
+        for (auto it = indirects.begin(); it != indirects.end();) {
+            int mappedDepth = (it->first >> 56) & 0xf;
+            uint64_t covered = 1;
+            for (int i = mappedDepth; i < height; i++) covered *= NUM_POINTERS;
+            uint64_t first = (it->first & ((1ULL << 56) - 1)) * covered;
+            if ((int) (it->first >> 60) == height && mappedDepth >= depth && first >= base && first < base + span) it = indirects.erase(it);
+            else ++it;
+        }
+    }
+
+    /**
+     * Makes sure a mapped indirect block is not shared with other files before it
+     * changes, giving it a copy of its own stored in the pointer referring to it
+     * if it is (the copy adds a reference to every block the shared one points to)
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int own(mappedIndirect& mapped, blockPtr& pointer) {
+        if (mapped.owned) return 0;
+        if (driver->getBlockRefCount(pointer) > 1) {
+            int start;
+            if (driver->allocateBlocks(pointer, 1, start) == 0) return 1; // failed to get a free block
+            for (int i = 0; i < NUM_POINTERS; i++) {
+                if (mapped.block.blockPointers[i] != -1 && driver->shareBlock(blockOf(mapped.block.blockPointers[i])) != 0) return 1; // failed to share block
+            }
+            if (driver->freeBlock(pointer) != 0) return 1; // failed to drop the reference to the shared block
+            STATS_COUNT(STAT_COW_COPIES, 1);
+            pointer = start;
+            mapped.blockNum = start;
+            mapped.dirty = true;
+        }
+        mapped.owned = true;
+        return 0;
+    }
+
+    /**
+     * Returns the slot of the pointer to the next level in an indirect block
+     * at the given depth of a tree
+     */
+    static int slot(int height, int depth, uint64_t relative) {
+        for (int i = depth + 1; i < height; i++) relative /= NUM_POINTERS;
+        return relative % NUM_POINTERS;
+    }
+
+    /**
+     * Unmaps the blocks at index from and past it in the subtree below the pointer
+     * at the given depth covering the blocks from base, collecting the freed data
+     * blocks and the indirect blocks left empty in freed
+     * (a shared subtree unmapped whole is freed as its top indirect block,
+     * which only drops a reference to it)
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int trim(int height, int depth, uint64_t base, blockPtr& pointer, uint64_t from, vector<int>& freed) {
+        if (pointer == -1) return 0;
+        if (depth == height) { // data block
+            if (base >= from) {
+                freed.push_back(blockOf(pointer));
+                pointer = -1;
+            }
+            return 0;
+        }
+        if (base >= from && driver->getBlockRefCount(pointer) > 1) { // the blocks below stay with the other files
+            freed.push_back(pointer);
+            pointer = -1;
+            forget(height, depth, base);
+            return 0;
+        }
+        uint64_t covered = 1;
+        for (int i = depth + 1; i < height; i++) covered *= NUM_POINTERS; // blocks below each slot
+        mappedIndirect* mapped = load(height, depth, base, pointer);
+        if (mapped == nullptr) return 1;
+        int first = base >= from ? 0 : (from - base) / covered;
+        bool empty = true;
+        for (int i = 0; i < NUM_POINTERS; i++) {
+            blockPtr& child = mapped->block.blockPointers[i];
+            if (i >= first && child != -1) {
+                if (own(*mapped, pointer) != 0) return 1; // failed to copy shared indirect block
+                if (trim(height, depth + 1, base + i * covered, child, from, freed) != 0) return 1;
+                mapped->dirty = true;
+            }
+            if (child != -1) empty = false;
+        }
+        if (empty) { // free the indirect block itself
+            freed.push_back(pointer);
+            pointer = -1;
+            uint64_t span = covered * NUM_POINTERS;
+            indirects.erase(key(height, depth, base / span));
+        }
+        return 0;
+    }
+
+    int lookupBlock(int index, int& blockNum, bool writing) {
+        blockNum = -1;
+        if (index < 0 || index >= MAX_FILE_BLOCKS) return 1; // file too large, size not supported by file system
+        uint64_t relative;
+        int height = locate(index, relative);
+        if (height == 0) { // direct block
+            blockNum = fileInode->direct[index];
+            return 0;
+        }
+        blockPtr* pointer = &fileInode->indirect[height - 1];
+        mappedIndirect* parent = nullptr;
+        for (int depth = 0; depth < height && *pointer != -1; depth++) {
+            mappedIndirect* mapped = load(height, depth, relative, *pointer);
+            if (mapped == nullptr) return 1;
+            if (writing) {
+                int previous = *pointer;
+                if (own(*mapped, *pointer) != 0) return 1; // failed to copy shared indirect block
+                if (*pointer != previous && parent != nullptr) parent->dirty = true;
+            }
+            parent = mapped;
+            pointer = &mapped->block.blockPointers[slot(height, depth, relative)];
+        }
+        blockNum = *pointer;
+        return 0;
+    }
+
+    /**
+     * Allocates a block next to the given goal block for a missing indirect block
+     * storing its number in the pointer referring to it
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int allocate(mappedIndirect& mapped, blockPtr& pointer, int goal) {
+        int start;
+        if (driver->allocateBlocks(goal, 1, start) == 0) return 1; // failed to get a free block
+        pointer = start;
+        mapped.blockNum = start;
+        mapped.dirty = true;
+        mapped.owned = true;
+        return 0;
+    }
+public:
+    /**
+     * Returns the pointer to a block reserved but never written
+     */
+    static int reserved(int blockNum) {
+        return ~blockNum;
+    }
+
+    /**
+     * Returns true if the pointer is to a block reserved but never written
+     */
+    static bool isReserved(int pointer) {
+        return pointer < -1;
+    }
+
+    /**
+     * Returns the block number a pointer refers to (-1 for a hole)
+     */
+    static int blockOf(int pointer) {
+        return pointer < -1 ? ~pointer : pointer;
+    }
+
+    /**
+     * Starts mapping the blocks of the given inode
+     */
+    void attach(VDiskDriver<G>& vdisk, inode& mappedInode) {
+        driver = &vdisk;
+        fileInode = &mappedInode;
+        reset();
+    }
+
+    /**
+     * Forgets every mapped indirect block (without writing them back)
+     */
+    void reset() {
+        std::lock_guard<std::mutex> guard(mapLock);
+        indirects.clear();
+    }
+
+    /**
+     * Stores the pointer to the block at the given index in the file
+     * in blockNum (-1 if it is not allocated), copying the shared indirect
+     * blocks on the way if writing so the block is shared only if it is itself
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int lookup(int index, int& blockNum, bool writing = false) {
+        std::lock_guard<std::mutex> guard(mapLock);
+        return lookupBlock(index, blockNum, writing);
+    }
+
+    /**
+     * Resolves count consecutive blocks of the file starting at the given index
+     * into their pointers (-1 for unallocated blocks), copying the shared
+     * indirect blocks on the way if writing
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int resolve(int firstIndex, int count, vector<int>& blocks, bool writing = false) {
+        std::lock_guard<std::mutex> guard(mapLock);
+        blocks.resize(count);
+        for (int i = 0; i < count; i++) {
+            if (lookupBlock(firstIndex + i, blocks[i], writing) != 0) return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Records blockNum as the pointer to the block at the given index in the file
+     * allocating any missing indirect blocks and copying shared ones (written back on flush)
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int assign(int index, int blockNum) {
+        std::lock_guard<std::mutex> guard(mapLock);
+        if (index < 0 || index >= MAX_FILE_BLOCKS) return 1; // file too large, size not supported by file system
+        uint64_t relative;
+        int height = locate(index, relative);
+        if (height == 0) { // direct block
+            fileInode->direct[index] = blockNum;
+            return 0;
+        }
+        blockPtr* pointer = &fileInode->indirect[height - 1];
+        mappedIndirect* parent = nullptr;
+        for (int depth = 0; depth < height; depth++) {
+            mappedIndirect* mapped = load(height, depth, relative, *pointer);
+            if (mapped == nullptr) return 1;
+            int previous = *pointer;
+            if (*pointer == -1) {
+                if (allocate(*mapped, *pointer, blockOf(blockNum)) != 0) return 1;
+            } else if (own(*mapped, *pointer) != 0) return 1; // failed to copy shared indirect block
+            if (*pointer != previous && parent != nullptr) parent->dirty = true;
+            parent = mapped;
+            pointer = &mapped->block.blockPointers[slot(height, depth, relative)];
+        }
+        *pointer = blockNum;
+        parent->dirty = true;
+        return 0;
+    }
+
+    /**
+     * Unmaps every block from the given index to the end of the file
+     * collecting the freed data blocks and the indirect blocks left empty in freed
+     * (to be freed by the caller)
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int truncate(int firstIndex, vector<int>& freed) {
+        std::lock_guard<std::mutex> guard(mapLock);
+        if (firstIndex < 0) return 1;
+        for (int i = firstIndex; i < NUM_DIRECT; i++) {
+            if (fileInode->direct[i] != -1) freed.push_back(blockOf(fileInode->direct[i]));
+            fileInode->direct[i] = -1;
+        }
+        uint64_t treeStart = NUM_DIRECT, span = NUM_POINTERS;
+        for (int height = 1; height <= G::NUM_INDIRECT; height++, treeStart += span, span *= NUM_POINTERS) {
+            uint64_t from = (uint64_t) firstIndex > treeStart ? firstIndex - treeStart : 0;
+            if (from >= span) continue;
+            if (trim(height, 0, 0, fileInode->indirect[height - 1], from, freed) != 0) return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Writes back every modified indirect block once
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int flush() {
+        std::lock_guard<std::mutex> guard(mapLock);
+        for (auto& entry : indirects) {
+            mappedIndirect& mapped = entry.second;
+            if (!mapped.dirty) continue;
+            STATS_COUNT(STAT_INDIRECT_WRITES, 1);
+            if (driver->updateBlock(reinterpret_cast<char*>(&mapped.block), mapped.blockNum) != 0) return 1; // failed to update indirect block
+            mapped.dirty = false;
+        }
+        return 0;
+    }
+};
@@ -0,0 +1,201 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include "backend.hxx"
+
+using std::vector;
+using std::unordered_map;
+
+typedef struct cacheStats_t {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t writebacks = 0;
+} cacheStats;
+
+/**
+ * Fixed-size write-back cache of disk blocks
+ * using the clock algorithm for eviction
+ */
+class BlockCache {
+private:
+    typedef struct frame_t {
+        int blockNum = -1;
+        bool dirty = false;
+        bool referenced = false;
+    } frame;
+
+    DiskBackend* disk = nullptr;
+    size_t blockSize;
+    vector<char> data;
+    vector<frame> frames;
+    unordered_map<int, size_t> index; // block number to frame
+    size_t clockHand = 0;
+    cacheStats stats;
+
+    char* frameData(size_t f) {
+        return data.data() + f * blockSize;
+    }
+
+    int writeBackFrame(size_t f) {
+        if (!frames[f].dirty) return 0;
+        if (disk->write(frameData(f), blockSize, (size_t) frames[f].blockNum * blockSize) != 0) return 1; // failed to write back
+        frames[f].dirty = false;
+        stats.writebacks++;
+        return 0;
+    }
+
+    /**
+     * Picks a frame to hold a new block evicting (and writing back)
+     * the first frame not referenced since the clock hand last passed it
+     *
+     * Returns the frame index or -1 on failure
+     */
+    long evict() {
+        while (true) {
+            size_t f = clockHand;
+            clockHand = (clockHand + 1) % frames.size();
+            if (frames[f].blockNum != -1 && frames[f].referenced) {
+                frames[f].referenced = false;
+                continue;
+            }
+            if (frames[f].blockNum != -1) {
+                if (writeBackFrame(f) != 0) return -1; // failed to write back victim
+                index.erase(frames[f].blockNum);
+            }
+            frames[f].blockNum = -1;
+            return f;
+        }
+    }
+
+    /**
+     * Returns the frame holding the given block, loading it from disk
+     * unless the caller is about to overwrite the whole block
+     *
+     * Returns -1 on failure
+     */
+    long getFrame(int blockNum, bool load) {
+        auto it = index.find(blockNum);
+        if (it != index.end()) {
+            stats.hits++;
+            frames[it->second].referenced = true;
+            return it->second;
+        }
+        stats.misses++;
+        long f = evict();
+        if (f == -1) return -1;
+        if (load && disk->read(frameData(f), blockSize, (size_t) blockNum * blockSize) != 0) return -1; // failed to load block
+        frames[f].blockNum = blockNum;
+        frames[f].dirty = false;
+        frames[f].referenced = true;
+        index[blockNum] = f;
+        return f;
+    }
+    /**
+     * Applies an operation to every frame caching one of count blocks
+     * starting from startBlock, stopping at the first failure
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    template <typename F>
+    int forEachCached(int startBlock, size_t count, F op) {
+        if (count > frames.size()) { // cheaper to scan the frames
+            for (size_t f = 0; f < frames.size(); f++) {
+                if (frames[f].blockNum >= startBlock && (size_t) (frames[f].blockNum - startBlock) < count && op(f) != 0) return 1;
+            }
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                auto it = index.find(startBlock + i);
+                if (it != index.end() && op(it->second) != 0) return 1;
+            }
+        }
+        return 0;
+    }
+public:
+    BlockCache(size_t numFrames, size_t blockSize) : blockSize(blockSize), data(numFrames * blockSize), frames(numFrames) {}
+
+    /**
+     * Starts caching blocks of the given disk
+     */
+    void attach(DiskBackend* backend) {
+        disk = backend;
+    }
+
+    /**
+     * Drops every cached block (without writing them back) and detaches the disk
+     */
+    void detach() {
+        for (frame& fr : frames) fr = frame();
+        index.clear();
+        clockHand = 0;
+        disk = nullptr;
+    }
+
+    /**
+     * Reads count bytes at the given offset in a block into the buffer
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int read(char* buffer, int blockNum, size_t offset, size_t count) {
+        if (offset + count > blockSize) return 1;
+        if (frames.empty()) return disk->read(buffer, count, (size_t) blockNum * blockSize + offset);
+        long f = getFrame(blockNum, true);
+        if (f == -1) return 1;
+        memcpy(buffer, frameData(f) + offset, count);
+        return 0;
+    }
+
+    /**
+     * Writes count bytes from the buffer at the given offset in a block,
+     * deferring the disk write until the block is evicted or flushed
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int write(const char* buffer, int blockNum, size_t offset, size_t count) {
+        if (offset + count > blockSize) return 1;
+        if (frames.empty()) return disk->write(buffer, count, (size_t) blockNum * blockSize + offset);
+        long f = getFrame(blockNum, count != blockSize);
+        if (f == -1) return 1;
+        memcpy(frameData(f) + offset, buffer, count);
+        frames[f].dirty = true;
+        return 0;
+    }
+
+    /**
+     * Writes back the cached dirty blocks among count blocks starting from startBlock
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int writeBack(int startBlock, size_t count) {
+        return forEachCached(startBlock, count, [&](size_t f) {
+            return writeBackFrame(f);
+        });
+    }
+
+    /**
+     * Drops the given blocks from the cache without writing them back
+     * (their contents are no longer needed once they are freed)
+     */
+    void discard(int startBlock, size_t count) {
+        forEachCached(startBlock, count, [&](size_t f) {
+            index.erase(frames[f].blockNum);
+            frames[f] = frame();
+            return 0;
+        });
+    }
+
+    /**
+     * Writes back every dirty block
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int flush() {
+        for (size_t f = 0; f < frames.size(); f++) {
+            if (frames[f].blockNum != -1 && writeBackFrame(f) != 0) return 1;
+        }
+        return 0;
+    }
+
+    cacheStats getStats() {
+        return stats;
+    }
+};
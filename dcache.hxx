@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "vdd.hxx"
+
+using std::vector;
+
+#define DCACHE_ENTRIES 1024 // must be a power of 2
+
+/**
+ * FNV-1a hash of a name
+ */
+inline uint32_t hashName(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= (unsigned char) c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Fixed-size cache of directory lookups keyed by (parent inode, name)
+ * remembering the inode number a name resolved to or that it was not found,
+ * with each key mapping to a single slot that a colliding key replaces
+ */
+class DentryCache {
+private:
+    typedef struct dentry_t {
+        bool valid = false;
+        int parentInodeNum = 0;
+        int inodeNum = 0; // NOT_FOUND for a negative entry
+        char name[sizeof(dirEntry::name)] = {0};
+    } dentry;
+
+    vector<dentry> slots;
+
+    dentry& slot(int parentInodeNum, std::string_view name) {
+        uint32_t hash = hashName(name) ^ ((uint32_t) parentInodeNum * 2654435761u);
+        return slots[hash & (slots.size() - 1)];
+    }
+public:
+    static const int NOT_FOUND = -2;
+
+    DentryCache(size_t numEntries = DCACHE_ENTRIES) : slots(numEntries) {}
+
+    /**
+     * Stores the cached inode number of a name in inodeNum
+     * (NOT_FOUND if the name is cached as missing)
+     *
+     * Returns true on a hit and false on a miss
+     */
+    bool lookup(int parentInodeNum, std::string_view name, int& inodeNum) {
+        if (name.size() >= sizeof(dentry::name)) return false;
+        dentry& entry = slot(parentInodeNum, name);
+        if (!entry.valid || entry.parentInodeNum != parentInodeNum || name != entry.name) return false;
+        inodeNum = entry.inodeNum;
+        return true;
+    }
+
+    /**
+     * Caches the inode number a name resolves to (NOT_FOUND if it is missing)
+     */
+    void insert(int parentInodeNum, std::string_view name, int inodeNum) {
+        if (name.size() >= sizeof(dentry::name)) return; // never a valid name
+        dentry& entry = slot(parentInodeNum, name);
+        entry.valid = true;
+        entry.parentInodeNum = parentInodeNum;
+        entry.inodeNum = inodeNum;
+        memset(entry.name, 0, sizeof(entry.name));
+        name.copy(entry.name, name.size());
+    }
+
+    /**
+     * Drops every entry of the given directory (its inode may be reused)
+     */
+    void invalidateDir(int parentInodeNum) {
+        for (dentry& entry : slots) {
+            if (entry.parentInodeNum == parentInodeNum) entry.valid = false;
+        }
+    }
+};
@@ -0,0 +1,1490 @@
+#pragma once
+#include "vdd.hxx"
+#include "blockmap.hxx"
+#include "dcache.hxx"
+#include "lz.hxx"
+#include <filesystem>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <sys/uio.h>
+
+using std::filesystem::exists;
+
+typedef struct returnInodes_t {
+    int inodeNum;
+    int parentInodeNum;
+} returnInodes;
+
+#define EXTENT_MAGIC 0x315a4c45 // first word of a compressed extent
+
+/**
+ * Header of a compressed extent in the first of its blocks
+ * followed by the compressed bytes
+ */
+typedef struct extentHeader_t {
+    uint32_t magic = EXTENT_MAGIC;
+    uint32_t compressedBytes = 0;
+    uint32_t size = 0; // bytes of the cluster compressed (the rest are zeros)
+} extentHeader;
+
+/**
+ * Read-only span of file data returned by readViews
+ */
+typedef struct readView_t {
+    const char* data;
+    size_t size;
+} readView;
+
+/**
+ * File system over a virtual disk laid out with the geometry G
+ */
+template <typename G>
+class BasicFileSystem {
+private:
+    typedef typename G::inode inode;
+    typedef typename G::dirBlock dirBlock;
+    typedef typename G::indirectBlock indirectBlock;
+    typedef typename VDiskDriver<G>::operation operation; // changes committed to the journal together
+    static constexpr size_t BLOCK_SIZE = G::BLOCK_SIZE;
+    static constexpr int NUM_DIRECT = G::NUM_DIRECT;
+    static constexpr int NUM_INDIRECT = G::NUM_INDIRECT;
+    static constexpr int NUM_POINTERS = G::NUM_POINTERS;
+    static constexpr int DIR_ENTRIES = G::DIR_ENTRIES;
+    static constexpr int MAX_FILE_BLOCKS = G::MAX_FILE_BLOCKS;
+    static constexpr size_t MAX_FILE_SIZE = (size_t) MAX_FILE_BLOCKS * BLOCK_SIZE;
+    static constexpr int CLUSTER_BLOCKS = G::CLUSTER_BLOCKS;
+    static constexpr size_t CLUSTER_SIZE = CLUSTER_BLOCKS * BLOCK_SIZE;
+    static constexpr size_t MAX_COMPRESSED_SIZE = (size_t) (MAX_FILE_BLOCKS / CLUSTER_BLOCKS) * CLUSTER_SIZE;
+
+    typedef struct clusterCache_t {
+        int index = -1; // cluster held (-1 for none)
+        bool dirty = false; // written since it was last stored
+        vector<char> data;
+        std::mutex lock; // serializes the readers sharing it
+    } clusterCache;
+
+    typedef struct openInode_t {
+        int inodeNum;
+        inode data;
+        BlockMap<G> blockMap;
+        int openCount = 0; // number of file descriptors referring to it
+        bool dirty = false; // changed since it was last stored in the inode table
+        clusterCache cluster; // last cluster used of a compressed file
+        std::shared_mutex lock; // shared by readers and held exclusively by writers
+    } openInode;
+
+    typedef struct pinnedRun_t {
+        const char* data; // returned by the driver when pinned
+        int startBlock;
+        int count;
+    } pinnedRun;
+
+    typedef struct viewSet_t {
+        vector<pinnedRun> runs; // blocks pinned in the driver
+        std::unique_ptr<char[]> decompressed; // bytes of a compressed file
+    } viewSet;
+
+    typedef struct openFile_t {
+        std::shared_ptr<openInode> file;
+        size_t readPointer = 0;
+        size_t writePointer = 0;
+        std::mutex lock; // serializes reads and writes moving the pointers
+    } openFile;
+
+    VDiskDriver<G> driver;
+    std::mutex namespaceLock; // serializes path operations, open and close
+    std::shared_mutex fileTableLock;
+    vector<std::shared_ptr<openFile>> fileTable; // indexed by file descriptor
+    unordered_map<int, std::shared_ptr<openInode>> openInodes; // shared by descriptors of the same file
+    DentryCache dentries; // guarded by namespaceLock like every path lookup
+    std::mutex viewLock;
+    unordered_map<int, viewSet> viewSets; // indexed by view handle
+    int nextViewHandle = 0;
+    static inline const char ZERO_BLOCK[BLOCK_SIZE] = {}; // viewed for holes
+    StatsDumper statsDumper;
+
+    std::shared_ptr<openFile> getFile(int fd) {
+        std::shared_lock<std::shared_mutex> guard(fileTableLock);
+        if (fd < 0 || fd >= (int) fileTable.size()) return nullptr;
+        return fileTable[fd];
+    }
+
+    /**
+     * Walks a path without copying it storing its last component in name
+     * (a view into the path)
+     *
+     * Returns the inode numbers of the path and its parent dir
+     * with -2 if only the last component is missing and -3 if the path is invalid
+     */
+    returnInodes getInode(std::string_view path, std::string_view& name) {
+        STATS_TIME(TIMER_LOOKUP);
+        name = std::string_view();
+        if (path.empty() || path[0] != '/') return returnInodes {-3, -3}; // invalid path
+        if (path.size() == 1) return returnInodes {-1, -1}; // root dir
+        path.remove_prefix(1);
+        int parentInodeNum = -1; // inode number for root dir
+        while (true) {
+            size_t pos = path.find('/');
+            name = path.substr(0, pos);
+            int inodeNum = getSubDirInodeNum(parentInodeNum, name);
+            if (pos == std::string_view::npos) return returnInodes {inodeNum, parentInodeNum};
+            if (inodeNum == -2 || inodeNum == -3) return returnInodes {-3, -3}; // missing dir in the middle of the path
+            path.remove_prefix(pos + 1);
+            parentInodeNum = inodeNum;
+        }
+    }
+
+    int getSubDirInodeNum(int parentInodeNum, std::string_view name) {
+        if (name.empty()) return -3; // name cannot be empty
+        STATS_COUNT(STAT_LOOKUP_COMPONENTS, 1);
+        int inodeNum;
+        if (dentries.lookup(parentInodeNum, name, inodeNum)) {
+            STATS_COUNT(STAT_DENTRY_HITS, 1);
+            return inodeNum;
+        }
+        inode parentInode;
+        if (driver.getInode(parentInodeNum, reinterpret_cast<char*>(&parentInode)) != 0) return -3; // failed to read inode
+        if (parentInode.flags != 1) return -3; // parent is not a dir
+        if (name.size() >= sizeof(dirEntry::name)) return -2; // name too long to exist
+        dirBlock dir;
+        int blockNum;
+        if (readDirBucket(parentInode, name, dir, blockNum) != 0) return -3; // failed to read
+        int slot = findDirEntry(dir, name);
+        inodeNum = slot == -1 ? -2 : dir.entries[slot].inode;
+        dentries.insert(parentInodeNum, name, inodeNum);
+        return inodeNum;
+    }
+
+    /**
+     * Returns the slot of the entry with the given name in a directory block or -1
+     */
+    static int findDirEntry(dirBlock& dir, std::string_view name) {
+        for (int i = 0; i < DIR_ENTRIES; i++) {
+            if (dir.entries[i].inode != 0 && strnlen(dir.entries[i].name, sizeof(dir.entries[i].name)) == name.size()
+                && memcmp(dir.entries[i].name, name.data(), name.size()) == 0) return i;
+        }
+        return -1;
+    }
+
+    /**
+     * Reads the block of a directory holding the bucket the given name hashes to
+     * ("." and ".." are always in the first block)
+     */
+    int readDirBucket(inode& dirInode, std::string_view name, dirBlock& dir, int& blockNum) {
+        int buckets = dirInode.size / BLOCK_SIZE;
+        int bucket = name == "." || name == ".." ? 0 : hashName(name) & (buckets - 1);
+        BlockMap<G> dirMap;
+        dirMap.attach(driver, dirInode);
+        if (dirMap.lookup(bucket, blockNum) != 0 || blockNum == -1) return 1; // failed to resolve bucket block
+        return driver.readBlock(reinterpret_cast<char*>(&dir), blockNum);
+    }
+
+    /**
+     * Doubles the number of buckets of a directory splitting the entries
+     * of every bucket between it and its new sibling bucket
+     */
+    int growDir(int dirInodeNum, inode& dirInode) {
+        int buckets = dirInode.size / BLOCK_SIZE;
+        if (buckets * 2 > MAX_FILE_BLOCKS) return 1; // dir too large
+        BlockMap<G> dirMap;
+        dirMap.attach(driver, dirInode);
+        vector<int> oldBlocks;
+        if (dirMap.resolve(0, buckets, oldBlocks) != 0) return 1; // failed to resolve dir blocks
+        int allocatedBuckets = 0;
+        while (allocatedBuckets < buckets) {
+            int start;
+            int allocated = driver.allocateBlocks(oldBlocks.back() + 1, buckets - allocatedBuckets, start);
+            if (allocated == 0) return 1; // failed to get free blocks
+            for (int i = 0; i < allocated; i++) {
+                if (dirMap.assign(buckets + allocatedBuckets + i, start + i) != 0) return 1; // failed to record dir block
+            }
+            allocatedBuckets += allocated;
+        }
+        for (int bucket = 0; bucket < buckets; bucket++) {
+            dirBlock oldDir, newDir;
+            if (driver.readBlock(reinterpret_cast<char*>(&oldDir), oldBlocks[bucket]) != 0) return 1; // failed to read dir block
+            int newSlot = 0;
+            for (int i = bucket == 0 ? 2 : 0; i < DIR_ENTRIES; i++) {
+                if (oldDir.entries[i].inode == 0) continue;
+                if ((hashName(oldDir.entries[i].name) & (buckets * 2 - 1)) != (uint32_t) bucket) { // moves to the sibling bucket
+                    newDir.entries[newSlot++] = oldDir.entries[i];
+                    oldDir.entries[i] = dirEntry();
+                }
+            }
+            int newBlockNum;
+            if (dirMap.lookup(buckets + bucket, newBlockNum) != 0) return 1; // failed to resolve dir block
+            if (driver.updateBlock(reinterpret_cast<char*>(&newDir), newBlockNum) != 0) return 1; // failed to write dir block
+            if (driver.updateBlock(reinterpret_cast<char*>(&oldDir), oldBlocks[bucket]) != 0) return 1; // failed to update dir block
+        }
+        if (dirMap.flush() != 0) return 1; // failed to write back indirect blocks
+        dirInode.size = buckets * 2 * BLOCK_SIZE;
+        return driver.updateInode(dirInodeNum, reinterpret_cast<char*>(&dirInode));
+    }
+
+    /**
+     * Adds an entry to a directory growing it if the bucket of the name is full
+     */
+    int addDirEntry(int dirInodeNum, std::string_view name, int inodeNum) {
+        if (name.size() >= sizeof(dirEntry::name)) return 1; // name too long
+        inode dirInode;
+        if (driver.getInode(dirInodeNum, reinterpret_cast<char*>(&dirInode)) != 0) return 1; // failed to read inode
+        while (true) {
+            dirBlock dir;
+            int blockNum;
+            if (readDirBucket(dirInode, name, dir, blockNum) != 0) return 1; // failed to read block
+            for (dirEntry& entry : dir.entries) {
+                if (entry.inode == 0) { // find a free entry in the bucket
+                    entry.inode = inodeNum;
+                    memset(entry.name, 0, sizeof(entry.name));
+                    name.copy(entry.name, name.size());
+                    if (driver.updateBlock(reinterpret_cast<char*>(&dir), blockNum) != 0) return 1; // failed to update dir block
+                    dentries.insert(dirInodeNum, name, inodeNum);
+                    return 0;
+                }
+            }
+            if (growDir(dirInodeNum, dirInode) != 0) return 1; // bucket is full and dir cannot grow
+        }
+    }
+
+    /**
+     * Removes the entry with the given name from a directory
+     */
+    int removeDirEntry(int dirInodeNum, std::string_view name) {
+        inode dirInode;
+        if (driver.getInode(dirInodeNum, reinterpret_cast<char*>(&dirInode)) != 0) return 1; // failed to read inode
+        dirBlock dir;
+        int blockNum;
+        if (readDirBucket(dirInode, name, dir, blockNum) != 0) return 1; // failed to read block
+        int slot = findDirEntry(dir, name);
+        if (slot == -1) return 1; // could not find entry in dir
+        dir.entries[slot] = dirEntry();
+        if (driver.updateBlock(reinterpret_cast<char*>(&dir), blockNum) != 0) return 1; // failed to update dir block
+        dentries.insert(dirInodeNum, name, -2);
+        return 0;
+    }
+
+    /**
+     * Writes bytesToWrite bytes (at most one block) from the buffer into the block
+     * at the given offset in the block, allocating it next to the goal block if
+     * blockNum is -1, with the rest of the block taken from the source block
+     * (zeros if source is -1, as a block never written before reads)
+     */
+    int writeBytesToDisk(char* buffer, int bytesToWrite, int byteOffset, int& blockNum, int goal, int source) {
+        if (bytesToWrite > BLOCK_SIZE) return 1;
+        char block[BLOCK_SIZE];
+        if (blockNum == -1) { // allocate new block next to the goal block
+            if (driver.allocateBlocks(goal, 1, blockNum) == 0) return 1; // failed to get a free block
+        }
+        if (bytesToWrite < BLOCK_SIZE) { // partial update of the source block
+            if (source == -1) memset(block, 0, BLOCK_SIZE);
+            else if (driver.readBlock(block, source) != 0) return 1; // failed to read block
+        }
+        if (bytesToWrite < BLOCK_SIZE) { // partial block write
+            // copy (bytesToWrite) bytes from buffer into block at (byteOffset)
+            memcpy(block + byteOffset, buffer, bytesToWrite);
+            buffer = block;
+        }
+        if (driver.updateDataBlock(buffer, blockNum) != 0) return 1; // failed to update block
+        return 0;
+    }
+
+    int readBytesFromDisk(char* buffer, int bytesToRead, int byteOffset, int blockNum) {
+        if (bytesToRead > BLOCK_SIZE) return 1;
+        if (blockNum < 0) { // a hole or a block never written reads as zeros
+            memset(buffer, 0, bytesToRead);
+            return 0;
+        }
+        else if (bytesToRead < BLOCK_SIZE) { // partial block read
+            char block[BLOCK_SIZE];
+            if (driver.readBlock(block, blockNum) != 0) return 1; // failed to read block
+            // copy (bytesToRead) bytes from block at (byteOffset) into buffer
+            memcpy(buffer, block + byteOffset, bytesToRead);
+        } else { // full block read
+            if (driver.readBlock(buffer, blockNum) != 0) return 1; // failed to read block
+        }
+        return 0;
+    }
+
+    /**
+     * Returns true if writes to the block must go to a copy of it:
+     * it is shared with other files or pinned by read views
+     */
+    bool copyOnWrite(int blockNum) {
+        return driver.getBlockRefCount(blockNum) > 1 || driver.isPinned(blockNum);
+    }
+
+    /**
+     * Writes bytesToWrite bytes (at most one block) from the buffer into the block
+     * at the given index in the file at the given offset in the block
+     * allocating it if missing or copying it if shared with other files
+     */
+    int writeBlockAt(openInode& file, char* buffer, int bytesToWrite, int byteOffset, int index) {
+        int pointer, previous = -1;
+        if (file.blockMap.lookup(index, pointer, true) != 0) return 1; // failed to resolve block
+        int blockNum = BlockMap<G>::blockOf(pointer);
+        bool shared = blockNum != -1 && copyOnWrite(blockNum);
+        if ((pointer == -1 || shared) && index > 0 && file.blockMap.lookup(index - 1, previous) != 0) return 1; // failed to resolve previous block
+        previous = BlockMap<G>::blockOf(previous);
+        int source = pointer < 0 ? -1 : blockNum; // a hole or a reserved block reads as zeros
+        if (shared) blockNum = -1; // written to a copy of its own
+        if (writeBytesToDisk(buffer, bytesToWrite, byteOffset, blockNum, previous == -1 ? -1 : previous + 1, source) != 0) return 1; // failed to write bytes
+        if (blockNum != pointer && file.blockMap.assign(index, blockNum) != 0) return 1; // failed to record block
+        if (shared) {
+            STATS_COUNT(STAT_COW_COPIES, 1);
+            if (driver.freeBlock(BlockMap<G>::blockOf(pointer)) != 0) return 1; // failed to drop the reference to the shared block
+        }
+        return 0;
+    }
+
+    /**
+     * Writes count full blocks from the buffer into the file starting at
+     * the given block index, allocating missing blocks and copies of blocks
+     * shared with other files in contiguous runs and writing each run
+     * of contiguous blocks with a single disk write
+     */
+    int writeFullBlocks(openInode& file, char* buffer, int firstIndex, int count) {
+        vector<int> blocks, shared;
+        if (file.blockMap.resolve(firstIndex, count, blocks, true) != 0) return 1; // failed to resolve blocks
+        for (int i = 0; i < count; i++) {
+            if (blocks[i] != -1 && copyOnWrite(BlockMap<G>::blockOf(blocks[i]))) { // replaced by a copy
+                shared.push_back(BlockMap<G>::blockOf(blocks[i]));
+                blocks[i] = -1;
+            }
+        }
+        int previous = -1;
+        if (firstIndex > 0 && file.blockMap.lookup(firstIndex - 1, previous) != 0) return 1; // failed to resolve previous block
+        previous = BlockMap<G>::blockOf(previous);
+        for (int i = 0; i < count; i++) {
+            if (BlockMap<G>::isReserved(blocks[i])) { // written for the first time
+                blocks[i] = BlockMap<G>::blockOf(blocks[i]);
+                if (file.blockMap.assign(firstIndex + i, blocks[i]) != 0) return 1; // failed to record block
+            } else if (blocks[i] == -1) { // allocate the missing blocks next to the previous one
+                int missing = 1;
+                while (i + missing < count && blocks[i + missing] == -1) missing++;
+                int start;
+                int allocated = driver.allocateBlocks(previous == -1 ? -1 : previous + 1, missing, start);
+                if (allocated == 0) return 1; // failed to get free blocks
+                for (int j = 0; j < allocated; j++) {
+                    blocks[i + j] = start + j;
+                    if (file.blockMap.assign(firstIndex + i + j, start + j) != 0) return 1; // failed to record block
+                }
+                i += allocated - 1;
+            }
+            previous = blocks[i];
+        }
+        STATS_COUNT(STAT_COW_COPIES, shared.size());
+        if (freeBlockList(shared) != 0) return 1; // failed to drop the references to the shared blocks
+        int runStart = 0;
+        for (int i = 1; i <= count; i++) {
+            if (i == count || blocks[i] != blocks[i - 1] + 1) {
+                if (driver.writeBlocks(buffer + runStart * BLOCK_SIZE, blocks[runStart], i - runStart) != 0) return 1; // failed to write blocks
+                runStart = i;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Reads count full blocks of the file starting at the given block index
+     * into the buffer reading each run of contiguous blocks with a single disk read
+     */
+    int readFullBlocks(openInode& file, char* buffer, int firstIndex, int count) {
+        vector<int> blocks;
+        if (file.blockMap.resolve(firstIndex, count, blocks) != 0) return 1; // failed to resolve blocks
+        int runStart = 0;
+        while (runStart < count) {
+            if (blocks[runStart] < 0) { // a hole or a block never written reads as zeros
+                memset(buffer + (size_t) runStart * BLOCK_SIZE, 0, BLOCK_SIZE);
+                runStart++;
+                continue;
+            }
+            int runEnd = runStart + 1;
+            while (runEnd < count && blocks[runEnd] == blocks[runEnd - 1] + 1) runEnd++;
+            if (driver.readBlocks(buffer + (size_t) runStart * BLOCK_SIZE, blocks[runStart], runEnd - runStart) != 0) return 1; // failed to read blocks
+            runStart = runEnd;
+        }
+        return 0;
+    }
+
+    /**
+     * Collects the blocks of a tree of indirect blocks of the given height
+     * (1 for single indirect) including the indirect blocks
+     * (only the top block of a tree shared with other files, whose blocks
+     * stay with them once freeing it drops the reference)
+     */
+    int collectIndirect(int blockNum, int height, vector<int>& blocks) {
+        if (blockNum == -1) return 0;
+        if (driver.getBlockRefCount(blockNum) > 1) {
+            blocks.push_back(blockNum);
+            return 0;
+        }
+        indirectBlock indirect;
+        if (driver.readBlock(reinterpret_cast<char*>(&indirect), blockNum) != 0) return 1; // failed to read indirect block
+        for (int i = 0; i < NUM_POINTERS; i++) {
+            if (height == 1) {
+                if (indirect.blockPointers[i] != -1) blocks.push_back(BlockMap<G>::blockOf(indirect.blockPointers[i]));
+            } else if (collectIndirect(indirect.blockPointers[i], height - 1, blocks) != 0) return 1; // failed to read blocks through lower indirect block
+        }
+        blocks.push_back(blockNum);
+        return 0;
+    }
+
+    /**
+     * Collects the data and indirect blocks of a file or directory
+     */
+    int collectBlocks(inode& fileInode, vector<int>& blocks) {
+        for (int i = 0; i < NUM_DIRECT; i++) {
+            if (fileInode.direct[i] != -1) blocks.push_back(BlockMap<G>::blockOf(fileInode.direct[i]));
+        }
+        for (int i = 0; i < NUM_INDIRECT; i++) {
+            if (collectIndirect(fileInode.indirect[i], i + 1, blocks) != 0) return 1; // failed to read blocks through indirect blocks
+        }
+        return 0;
+    }
+
+    /**
+     * Adds a reference to every block an inode points to directly
+     * (dropping the references added so far if one fails)
+     */
+    int shareBlocks(inode& fileInode) {
+        vector<int> shared;
+        for (int i = 0; i < NUM_DIRECT + NUM_INDIRECT; i++) {
+            int pointer = i < NUM_DIRECT ? fileInode.direct[i] : fileInode.indirect[i - NUM_DIRECT];
+            if (pointer == -1) continue;
+            if (driver.shareBlock(BlockMap<G>::blockOf(pointer)) != 0) { // too many references
+                freeBlockList(shared);
+                return 1;
+            }
+            shared.push_back(BlockMap<G>::blockOf(pointer));
+        }
+        return 0;
+    }
+
+    int freeBlockList(vector<int>& blocks) {
+        // free runs of consecutive block numbers at once
+        std::sort(blocks.begin(), blocks.end());
+        size_t runStart = 0;
+        for (size_t i = 1; i <= blocks.size(); i++) {
+            if (i == blocks.size() || blocks[i] != blocks[i - 1] + 1) {
+                if (driver.freeBlockRange(blocks[runStart], i - runStart) != 0) return 1; // failed to free blocks
+                runStart = i;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Returns true if the file stores its data in compressed clusters
+     */
+    static bool isCompressed(openInode& file) {
+        return (file.data.attributes & FILE_COMPRESSED) != 0;
+    }
+
+    /**
+     * Reads the blocks of the list into consecutive blocks of the buffer
+     * reading each run of contiguous blocks with a single disk read
+     */
+    int readBlockList(char* buffer, vector<int>& blocks) {
+        size_t runStart = 0;
+        for (size_t i = 1; i <= blocks.size(); i++) {
+            if (i == blocks.size() || blocks[i] != blocks[i - 1] + 1) {
+                if (driver.readBlocks(buffer + runStart * BLOCK_SIZE, blocks[runStart], i - runStart) != 0) return 1; // failed to read blocks
+                runStart = i;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Writes consecutive blocks of the buffer into the blocks of the list
+     * writing each run of contiguous blocks with a single disk write
+     */
+    int writeBlockList(char* buffer, vector<int>& blocks) {
+        size_t runStart = 0;
+        for (size_t i = 1; i <= blocks.size(); i++) {
+            if (i == blocks.size() || blocks[i] != blocks[i - 1] + 1) {
+                if (driver.writeBlocks(buffer + runStart * BLOCK_SIZE, blocks[runStart], i - runStart) != 0) return 1; // failed to write blocks
+                runStart = i;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Reads the cluster at the given index of a compressed file into
+     * CLUSTER_SIZE bytes of data, decompressing it if it is stored as an extent
+     *
+     * The blocks of an extent are recorded like reserved blocks
+     * (which compressed files never have) in the leading pointers
+     * of the cluster, any other cluster is made of raw blocks and holes
+     */
+    int readCluster(openInode& file, int cluster, char* data) {
+        vector<int> pointers;
+        if (file.blockMap.resolve(cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS, pointers) != 0) return 1; // failed to resolve blocks
+        if (!BlockMap<G>::isReserved(pointers[0])) return readFullBlocks(file, data, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS);
+        vector<int> blocks;
+        for (int i = 0; i < CLUSTER_BLOCKS && BlockMap<G>::isReserved(pointers[i]); i++) blocks.push_back(BlockMap<G>::blockOf(pointers[i]));
+        vector<char> extent(blocks.size() * BLOCK_SIZE);
+        if (readBlockList(extent.data(), blocks) != 0) return 1; // failed to read extent
+        extentHeader header;
+        memcpy(&header, extent.data(), sizeof(header));
+        if (header.magic != EXTENT_MAGIC || header.compressedBytes > extent.size() - sizeof(header) || header.size > CLUSTER_SIZE) return 1; // corrupt extent
+        if (LZ::decompress(extent.data() + sizeof(header), header.compressedBytes, data, header.size) != 0) return 1; // corrupt compressed bytes
+        memset(data + header.size, 0, CLUSTER_SIZE - header.size);
+        return 0;
+    }
+
+    /**
+     * Stores the cached cluster of a compressed file if it was written:
+     * all zeros as holes, as an extent if compressing it saves a block
+     * and otherwise as raw blocks for its blocks that are not all zeros,
+     * always in newly allocated blocks so blocks shared with clones never change
+     */
+    int storeCluster(openInode& file) {
+        clusterCache& cache = file.cluster;
+        if (!cache.dirty) return 0;
+        int firstIndex = cache.index * CLUSTER_BLOCKS;
+        vector<int> pointers;
+        if (file.blockMap.resolve(firstIndex, CLUSTER_BLOCKS, pointers) != 0) return 1; // failed to resolve blocks
+        bool zero[CLUSTER_BLOCKS];
+        int rawBlocks = 0;
+        size_t used = 0; // bytes up to the end of the last block that is not all zeros
+        for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+            const char* block = cache.data.data() + i * BLOCK_SIZE;
+            zero[i] = block[0] == 0 && memcmp(block, block + 1, BLOCK_SIZE - 1) == 0;
+            if (!zero[i]) {
+                rawBlocks++;
+                used = (i + 1) * BLOCK_SIZE;
+            }
+        }
+        vector<char> packed(rawBlocks * BLOCK_SIZE);
+        int extentBlocks = 0;
+        if (rawBlocks > 1) {
+            extentHeader header;
+            header.size = used;
+            header.compressedBytes = LZ::compress(cache.data.data(), used, packed.data() + sizeof(header), packed.size() - BLOCK_SIZE - sizeof(header));
+            if (header.compressedBytes != 0) { // fits in fewer blocks than the raw blocks
+                memcpy(packed.data(), &header, sizeof(header));
+                size_t extentSize = sizeof(header) + header.compressedBytes;
+                extentBlocks = (extentSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                memset(packed.data() + extentSize, 0, extentBlocks * BLOCK_SIZE - extentSize);
+            }
+        }
+        if (extentBlocks == 0) {
+            for (int i = 0, next = 0; i < CLUSTER_BLOCKS; i++) {
+                if (!zero[i]) memcpy(packed.data() + (next++) * BLOCK_SIZE, cache.data.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+            }
+        }
+        int newBlocks = extentBlocks != 0 ? extentBlocks : rawBlocks;
+        STATS_COUNT(STAT_COMPRESS_BYTES_IN, used);
+        STATS_COUNT(STAT_COMPRESS_BYTES_OUT, newBlocks * BLOCK_SIZE);
+        // allocate next to the blocks replaced or to the end of the previous cluster
+        int goal = -1;
+        for (int i = 0; i < CLUSTER_BLOCKS && goal == -1; i++) goal = BlockMap<G>::blockOf(pointers[i]);
+        if (goal == -1 && firstIndex > 0) {
+            vector<int> previous;
+            if (file.blockMap.resolve(firstIndex - CLUSTER_BLOCKS, CLUSTER_BLOCKS, previous) != 0) return 1; // failed to resolve previous blocks
+            for (int i = CLUSTER_BLOCKS - 1; i >= 0 && goal == -1; i--) {
+                if (previous[i] != -1) goal = BlockMap<G>::blockOf(previous[i]) + 1;
+            }
+        }
+        vector<int> blocks;
+        while ((int) blocks.size() < newBlocks) {
+            int start;
+            int allocated = driver.allocateBlocks(blocks.empty() ? goal : blocks.back() + 1, newBlocks - blocks.size(), start);
+            if (allocated == 0) { // not enough free blocks, the cluster keeps its blocks
+                freeBlockList(blocks);
+                return 1;
+            }
+            for (int j = 0; j < allocated; j++) blocks.push_back(start + j);
+        }
+        if (writeBlockList(packed.data(), blocks) != 0) return 1; // failed to write blocks
+        vector<int> replaced;
+        for (int i = 0, next = 0; i < CLUSTER_BLOCKS; i++) {
+            int pointer = -1;
+            if (extentBlocks != 0) {
+                if (i < extentBlocks) pointer = BlockMap<G>::reserved(blocks[i]);
+            } else if (!zero[i]) pointer = blocks[next++];
+            if (pointers[i] != -1) replaced.push_back(BlockMap<G>::blockOf(pointers[i]));
+            if (pointer != pointers[i] && file.blockMap.assign(firstIndex + i, pointer) != 0) return 1; // failed to record block
+        }
+        if (freeBlockList(replaced) != 0) return 1; // failed to free (or drop the references to) the replaced blocks
+        cache.dirty = false;
+        return 0;
+    }
+
+    /**
+     * Makes the cluster at the given index of a compressed file the cached
+     * cluster, storing the cached cluster first if it was written
+     * and reading the cluster unless it is about to be overwritten
+     */
+    int cacheCluster(openInode& file, int cluster, bool overwrite) {
+        clusterCache& cache = file.cluster;
+        if (cache.index == cluster) return 0;
+        if (storeCluster(file) != 0) return 1; // failed to store the written cluster
+        cache.index = -1;
+        cache.data.resize(CLUSTER_SIZE);
+        if (!overwrite && readCluster(file, cluster, cache.data.data()) != 0) return 1; // failed to read cluster
+        cache.index = cluster;
+        return 0;
+    }
+
+    /**
+     * Writes count bytes from the buffer into a compressed file at the given
+     * offset through the cached cluster, stored once another cluster is written
+     * or the file is synced or closed (the caller holds the inode lock exclusively)
+     */
+    int writeCompressed(openInode& file, char* buffer, size_t count, size_t offset) {
+        if (offset > MAX_COMPRESSED_SIZE || count > MAX_COMPRESSED_SIZE - offset) return 1; // file too large, size not supported by file system
+        while (count > 0) {
+            size_t clusterOffset = offset % CLUSTER_SIZE;
+            size_t bytesToWrite = std::min(count, CLUSTER_SIZE - clusterOffset);
+            if (cacheCluster(file, offset / CLUSTER_SIZE, bytesToWrite == CLUSTER_SIZE) != 0) return 1; // failed to read cluster
+            memcpy(file.cluster.data.data() + clusterOffset, buffer, bytesToWrite);
+            file.cluster.dirty = true;
+            offset += bytesToWrite;
+            buffer += bytesToWrite;
+            count -= bytesToWrite;
+            if (offset > (size_t) file.data.size) file.data.size = offset;
+        }
+        if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+        file.dirty = true; // stored in the inode table on close or sync
+        return 0;
+    }
+
+    /**
+     * Reads count bytes from a compressed file at the given offset into the buffer
+     * decompressing whole clusters directly into it and other clusters through
+     * the cached cluster (the caller holds the inode lock shared)
+     */
+    int readCompressed(openInode& file, char* buffer, size_t count, size_t offset) {
+        clusterCache& cache = file.cluster;
+        std::lock_guard<std::mutex> guard(cache.lock);
+        vector<char> scratch;
+        while (count > 0) {
+            int cluster = offset / CLUSTER_SIZE;
+            size_t clusterOffset = offset % CLUSTER_SIZE;
+            size_t bytesToRead = std::min(count, CLUSTER_SIZE - clusterOffset);
+            if (cache.index != cluster && bytesToRead == CLUSTER_SIZE) {
+                if (readCluster(file, cluster, buffer) != 0) return 1; // failed to read cluster
+            } else if (cache.index == cluster || !cache.dirty) {
+                if (cacheCluster(file, cluster, false) != 0) return 1; // failed to read cluster
+                memcpy(buffer, cache.data.data() + clusterOffset, bytesToRead);
+            } else { // the written cluster stays cached until a writer stores it
+                scratch.resize(CLUSTER_SIZE);
+                if (readCluster(file, cluster, scratch.data()) != 0) return 1; // failed to read cluster
+                memcpy(buffer, scratch.data() + clusterOffset, bytesToRead);
+            }
+            offset += bytesToRead;
+            buffer += bytesToRead;
+            count -= bytesToRead;
+        }
+        return 0;
+    }
+
+    /**
+     * Unmaps the clusters of a compressed file past the given smaller size
+     * and zeros the tail of the last cluster kept
+     */
+    int truncateCompressed(openInode& file, size_t size) {
+        int keptClusters = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        if (file.cluster.index >= keptClusters) { // dropped along with its blocks
+            file.cluster.index = -1;
+            file.cluster.dirty = false;
+        }
+        vector<int> freed;
+        if (file.blockMap.truncate(keptClusters * CLUSTER_BLOCKS, freed) != 0) return 1; // failed to unmap blocks
+        if (freeBlockList(freed) != 0) return 1; // failed to free blocks
+        if (size % CLUSTER_SIZE != 0) { // zero the tail of the last cluster so growing the file again reads zeros
+            if (cacheCluster(file, keptClusters - 1, false) != 0) return 1; // failed to read cluster
+            memset(file.cluster.data.data() + size % CLUSTER_SIZE, 0, CLUSTER_SIZE - size % CLUSTER_SIZE);
+            file.cluster.dirty = true;
+        }
+        return 0;
+    }
+
+    /**
+     * Writes count bytes from the buffer into the file at the given offset
+     * (the caller holds the inode lock exclusively)
+     */
+    int writeAt(openInode& file, char* buffer, size_t count, size_t offset) {
+        if (isCompressed(file)) return writeCompressed(file, buffer, count, offset);
+        int blocksNeeded = (offset + count) / BLOCK_SIZE + ((offset + count) % BLOCK_SIZE != 0);
+        int startingBlock = offset / BLOCK_SIZE;
+        for (int i = startingBlock; i < blocksNeeded; i++) {
+            int bytesToWrite = BLOCK_SIZE * (i + 1) - offset - (BLOCK_SIZE - offset % BLOCK_SIZE - count) * (i == blocksNeeded - 1);
+            if (offset % BLOCK_SIZE == 0 && count >= 2 * BLOCK_SIZE) { // write a run of full blocks
+                int fullBlocks = count / BLOCK_SIZE;
+                if (i + fullBlocks > MAX_FILE_BLOCKS) return 1; // file too large, size not supported by file system
+                if (writeFullBlocks(file, buffer, i, fullBlocks) != 0) return 1; // failed to write blocks
+                bytesToWrite = fullBlocks * BLOCK_SIZE;
+                i += fullBlocks - 1;
+            } else if (i < MAX_FILE_BLOCKS) { // write a single (possibly partial) block
+                if (writeBlockAt(file, buffer, bytesToWrite, offset % BLOCK_SIZE, i) != 0) return 1; // failed to write bytes
+            } else return 1; // file too large, size not supported by file system
+            offset += bytesToWrite;
+            buffer += bytesToWrite;
+            count -= bytesToWrite;
+            if (offset > (size_t) file.data.size) file.data.size = offset;
+        }
+        if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+        file.dirty = true; // stored in the inode table on close or sync
+        return 0;
+    }
+
+    /**
+     * Reads count bytes from the file at the given offset into the buffer
+     * (the caller holds the inode lock shared)
+     */
+    int readAt(openInode& file, char* buffer, size_t count, size_t offset) {
+        if (offset > (size_t) file.data.size || count > (size_t) file.data.size - offset) return 1; // reading past the end of the file
+        if (isCompressed(file)) return readCompressed(file, buffer, count, offset);
+        int blocksNeeded = (offset + count) / BLOCK_SIZE + ((offset + count) % BLOCK_SIZE != 0);
+        int startingBlock = offset / BLOCK_SIZE;
+        for (int i = startingBlock; i < blocksNeeded; i++) {
+            int bytesToRead = BLOCK_SIZE * (i + 1) - offset - (BLOCK_SIZE - offset % BLOCK_SIZE - count) * (i == blocksNeeded - 1);
+            if (offset % BLOCK_SIZE == 0 && count >= 2 * BLOCK_SIZE) { // read a run of full blocks
+                int fullBlocks = count / BLOCK_SIZE;
+                if (i + fullBlocks > MAX_FILE_BLOCKS) return 1; // file too large, size not supported by file system
+                if (readFullBlocks(file, buffer, i, fullBlocks) != 0) return 1; // failed to read blocks
+                bytesToRead = fullBlocks * BLOCK_SIZE;
+                i += fullBlocks - 1;
+            } else { // read a single (possibly partial) block
+                int blockNum;
+                if (file.blockMap.lookup(i, blockNum) != 0) return 1; // failed to resolve block or file too large
+                if (readBytesFromDisk(buffer, bytesToRead, offset % BLOCK_SIZE, blockNum) != 0) return 1; // failed to read bytes
+            }
+            offset += bytesToRead;
+            buffer += bytesToRead;
+            count -= bytesToRead;
+        }
+        return 0;
+    }
+
+    /**
+     * Collects views of count bytes of the file at the given offset pinning
+     * each run of contiguous blocks with the driver into the view set
+     * (the caller holds the inode lock shared)
+     */
+    int collectViews(openInode& file, size_t count, size_t offset, vector<readView>& views, viewSet& set) {
+        if (count == 0) return 0;
+        if (isCompressed(file)) { // decompressed once into memory held with the views
+            set.decompressed.reset(new char[count]);
+            if (readCompressed(file, set.decompressed.get(), count, offset) != 0) return 1; // failed to read clusters
+            views.push_back(readView {set.decompressed.get(), count});
+            return 0;
+        }
+        int firstIndex = offset / BLOCK_SIZE;
+        int numBlocks = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE - firstIndex;
+        vector<int> blocks;
+        if (file.blockMap.resolve(firstIndex, numBlocks, blocks) != 0) return 1; // failed to resolve blocks
+        int runStart = 0;
+        while (runStart < numBlocks) {
+            int runEnd = runStart + 1;
+            const char* data = ZERO_BLOCK; // a hole or a block never written reads as zeros
+            if (blocks[runStart] >= 0) {
+                while (runEnd < numBlocks && blocks[runEnd] == blocks[runEnd - 1] + 1) runEnd++;
+                data = driver.pinBlocks(blocks[runStart], runEnd - runStart);
+                if (data == nullptr) return 1; // failed to pin blocks
+                set.runs.push_back(pinnedRun {data, blocks[runStart], runEnd - runStart});
+            }
+            size_t runOffset = (size_t) (firstIndex + runStart) * BLOCK_SIZE;
+            size_t from = std::max(offset, runOffset), to = std::min(offset + count, (size_t) (firstIndex + runEnd) * BLOCK_SIZE);
+            views.push_back(readView {data + (from - runOffset), to - from});
+            runStart = runEnd;
+        }
+        return 0;
+    }
+
+    /**
+     * Releases the blocks pinned for a view set
+     * (within an operation as blocks freed while pinned are freed now)
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int unpinViews(viewSet& set) {
+        int result = 0;
+        for (pinnedRun& run : set.runs) result |= driver.unpinBlocks(run.data, run.startBlock, run.count);
+        set.runs.clear();
+        return result;
+    }
+
+    /**
+     * Stores the changed inodes and indirect blocks of every open file
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int storeOpenInodes() {
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        for (auto& entry : openInodes) {
+            openInode& file = *entry.second;
+            std::unique_lock<std::shared_mutex> inodeGuard(file.lock);
+            if (storeCluster(file) != 0) return 1; // failed to store the written cluster
+            if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+            if (file.dirty) {
+                if (driver.updateInode(file.inodeNum, reinterpret_cast<char*>(&file.data)) != 0) return 1; // failed to update inode
+                file.dirty = false;
+            }
+        }
+        return 0;
+    }
+
+public:
+    /**
+     * File system on the disk stored in the given image files,
+     * formatted first if the first one does not exist
+     * (blocks striped over several in stripes of stripeBlocks blocks)
+     */
+    BasicFileSystem(BackendType backendType = BACKEND_PREAD, size_t cacheBlocks = CACHE_BLOCKS,
+            long long numBlocks = DEFAULT_NUM_BLOCKS, long long numInodes = DEFAULT_NUM_INODES,
+            const vector<string>& images = {VDISK_FILE_NAME}, int stripeBlocks = STRIPE_BLOCKS) : driver(backendType, cacheBlocks, images) {
+        if (images.empty() || !exists(images[0]))
+            driver.format(numBlocks, numInodes, stripeBlocks);
+        driver.mount();
+    }
+
+    ~BasicFileSystem() {
+        {
+            operation op(driver);
+            for (auto& entry : viewSets) unpinViews(entry.second); // views still held end with the file system
+            viewSets.clear();
+        }
+        sync();
+    }
+
+    /**
+     * Creates a directory given a valid path that doesn't exist
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int mkdir(string& path) {
+        STATS_TIME(TIMER_MKDIR);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::string_view name;
+        returnInodes fetchedInodes = getInode(path, name);
+        if (fetchedInodes.inodeNum != -2) return 1; // dir already exists or invalid path
+        int inodeNum = driver.getFreeInode();
+        if (inodeNum == -1) return 1; // could not find a free inode
+        inode newInode(BLOCK_SIZE, 1);
+        int blockNum;
+        if (driver.allocateBlocks(-1, 1, blockNum) == 0) return 1; // could not find a free block
+        newInode.direct[0] = blockNum;
+        dirBlock newDir;
+        newDir.entries[0].inode = inodeNum;
+        strcpy(newDir.entries[0].name, ".");
+        newDir.entries[1].inode = fetchedInodes.parentInodeNum;
+        strcpy(newDir.entries[1].name, "..");
+        if (driver.updateBlock(reinterpret_cast<char*>(&newDir), blockNum) != 0) return 1; // failed to write dir block
+        if (driver.setInode(inodeNum, reinterpret_cast<char*>(&newInode)) != 0) return 1; // failed to write inode of dir
+        if (addDirEntry(fetchedInodes.parentInodeNum, name, inodeNum) != 0) { // parent dir is full or name too long
+            driver.freeBlock(blockNum);
+            driver.freeInode(inodeNum);
+            return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Removes a directory given a path of an existing empty directory
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int rmdir(string& path) {
+        STATS_TIME(TIMER_RMDIR);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::string_view name;
+        returnInodes fetchedInodes = getInode(path, name);
+        if (fetchedInodes.inodeNum <= 0) return 1; // dir not found or invalid path or root
+        inode childInode;
+        if (driver.getInode(fetchedInodes.inodeNum, reinterpret_cast<char*>(&childInode)) != 0) return 1; // failed to read inode
+        if (childInode.flags != 1) return 1; // path is not a dir
+        BlockMap<G> childMap;
+        childMap.attach(driver, childInode);
+        vector<int> childBlocks;
+        if (childMap.resolve(0, childInode.size / BLOCK_SIZE, childBlocks) != 0) return 1; // failed to resolve dir blocks
+        for (size_t bucket = 0; bucket < childBlocks.size(); bucket++) {
+            dirBlock childDir;
+            if (driver.readBlock(reinterpret_cast<char*>(&childDir), childBlocks[bucket]) != 0) return 1; // failed to read block
+            for (int i = bucket == 0 ? 2 : 0; i < DIR_ENTRIES; i++) {
+                if (childDir.entries[i].inode != 0) return 1; // dir is not empty
+            }
+        }
+        if (removeDirEntry(fetchedInodes.parentInodeNum, name) != 0) return 1; // could not find dir in parent dir
+        vector<int> blocks;
+        if (collectBlocks(childInode, blocks) != 0) return 1; // failed to read indirect blocks
+        if (freeBlockList(blocks) != 0) return 1; // failed to free dir blocks
+        dentries.invalidateDir(fetchedInodes.inodeNum);
+        if (driver.freeInode(fetchedInodes.inodeNum) != 0) return 1; // failed to free inode of dir
+        return 0;
+    }
+
+    /**
+     * Lists up to maxEntries entries (other than "." and "..") of a directory
+     * starting from the position in cookie, which starts at 0 and is advanced
+     * past the returned entries; an empty list means the end was reached
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int readdir(string& path, size_t& cookie, vector<dirEntry>& entries, size_t maxEntries) {
+        STATS_TIME(TIMER_READDIR);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        entries.clear();
+        std::string_view name;
+        int inodeNum = getInode(path, name).inodeNum;
+        if (inodeNum == -2 || inodeNum == -3) return 1; // dir not found or invalid path
+        inode dirInode;
+        if (driver.getInode(inodeNum, reinterpret_cast<char*>(&dirInode)) != 0) return 1; // failed to read inode
+        if (dirInode.flags != 1) return 1; // path is not a dir
+        BlockMap<G> dirMap;
+        dirMap.attach(driver, dirInode);
+        size_t buckets = dirInode.size / BLOCK_SIZE;
+        if (cookie < 2) cookie = 2; // skip "." and ".."
+        while (cookie < buckets * DIR_ENTRIES && entries.size() < maxEntries) {
+            int blockNum;
+            if (dirMap.lookup(cookie / DIR_ENTRIES, blockNum) != 0 || blockNum == -1) return 1; // failed to resolve dir block
+            dirBlock dir;
+            if (driver.readBlock(reinterpret_cast<char*>(&dir), blockNum) != 0) return 1; // failed to read block
+            do {
+                if (dir.entries[cookie % DIR_ENTRIES].inode != 0) entries.push_back(dir.entries[cookie % DIR_ENTRIES]);
+                cookie++;
+            } while (cookie % DIR_ENTRIES != 0 && entries.size() < maxEntries);
+        }
+        return 0;
+    }
+
+    /**
+     * Opens a file given a path if it exists or creates it if it does not
+     * 
+     * Returns a file descriptor on success and -1 on failure
+     */
+    int open(string& path) {
+        STATS_TIME(TIMER_OPEN);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::string_view name;
+        returnInodes fetchedInodes = getInode(path, name);
+        int inodeNum;
+        inode fileInode;
+        if (fetchedInodes.inodeNum == -2) { // file not found, have to create it
+            inodeNum = driver.getFreeInode();
+            if (inodeNum == -1) return -1; // could not find a free inode
+            if (driver.setInode(inodeNum, reinterpret_cast<char*>(&fileInode)) != 0) return -1; // failed to write inode of new file
+            if (addDirEntry(fetchedInodes.parentInodeNum, name, inodeNum) != 0) { // parent dir is full or name too long
+                driver.freeInode(inodeNum);
+                return -1;
+            }
+        } else if (fetchedInodes.inodeNum > 0) { // file is found, just open it
+            inodeNum = fetchedInodes.inodeNum;
+            if (openInodes.count(inodeNum) == 0) {
+                if (driver.getInode(inodeNum, reinterpret_cast<char*>(&fileInode)) != 0) return -1; // failed to read inode
+                if (fileInode.flags != 0) return -1; // path is not a file
+            }
+        } else return -1; // invalid path
+        // share the in-core inode with other descriptors of the same file
+        std::shared_ptr<openInode>& file = openInodes[inodeNum];
+        if (!file) {
+            file = std::make_shared<openInode>();
+            file->inodeNum = inodeNum;
+            file->data = fileInode;
+            file->blockMap.attach(driver, file->data);
+        }
+        file->openCount++;
+        std::shared_ptr<openFile> handle = std::make_shared<openFile>();
+        handle->file = file;
+        std::unique_lock<std::shared_mutex> tableGuard(fileTableLock);
+        for (size_t fd = 0; fd < fileTable.size(); fd++) {
+            if (!fileTable[fd]) {
+                fileTable[fd] = handle;
+                return fd;
+            }
+        }
+        fileTable.push_back(handle);
+        return fileTable.size() - 1;
+    }
+
+    /**
+     * Moves the write head of the file descriptor
+     * to the given number of bytes from the start of the file
+     * (past the end of the file a write leaves a hole reading as zeros)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int seekw(int fd, size_t count) {
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        std::lock_guard<std::mutex> guard(handle->lock);
+        if (count > MAX_FILE_SIZE) return 1; // file too large, size not supported by file system
+        handle->writePointer = count;
+        return 0;
+    }
+
+    /**
+     * Writes the given number of bytes from the buffer
+     * into the file at the file descriptor's write head
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int write(int fd, char* buffer, size_t count) {
+        STATS_TIME(TIMER_WRITE);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(handle->lock);
+        std::unique_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        if (writeAt(*handle->file, buffer, count, handle->writePointer) != 0) return 1;
+        STATS_COUNT(STAT_BYTES_WRITTEN, count);
+        handle->writePointer += count;
+        return 0;
+    }
+
+    /**
+     * Writes the given number of bytes from the buffer into the file
+     * at the given offset without moving the file descriptor's write head
+     * (past the end of the file only the written blocks are allocated)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int pwrite(int fd, char* buffer, size_t count, size_t offset) {
+        STATS_TIME(TIMER_WRITE);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        operation op(driver);
+        std::unique_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        if (offset > MAX_FILE_SIZE) return 1; // file too large, size not supported by file system
+        if (writeAt(*handle->file, buffer, count, offset) != 0) return 1;
+        STATS_COUNT(STAT_BYTES_WRITTEN, count);
+        return 0;
+    }
+
+    /**
+     * Sets the size of the file open with the file descriptor, freeing
+     * the blocks past the new end (and the indirect blocks left empty)
+     * or leaving a hole reading as zeros up to it
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int truncate(int fd, size_t size) {
+        STATS_TIME(TIMER_TRUNCATE);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        operation op(driver);
+        openInode& file = *handle->file;
+        std::unique_lock<std::shared_mutex> inodeGuard(file.lock);
+        if (size > MAX_FILE_SIZE) return 1; // file too large, size not supported by file system
+        if (size < (size_t) file.data.size && isCompressed(file)) {
+            if (truncateCompressed(file, size) != 0) return 1; // failed to unmap clusters
+        } else if (size < (size_t) file.data.size) {
+            vector<int> freed;
+            int keptBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (file.blockMap.truncate(keptBlocks, freed) != 0) return 1; // failed to unmap blocks
+            if (freeBlockList(freed) != 0) return 1; // failed to free blocks
+            if (size % BLOCK_SIZE != 0) { // zero the tail of the last block so growing the file again reads zeros
+                int blockNum;
+                if (file.blockMap.lookup(keptBlocks - 1, blockNum) != 0) return 1; // failed to resolve block
+                if (blockNum >= 0) {
+                    char zeros[BLOCK_SIZE] = {0};
+                    if (writeBlockAt(file, zeros, BLOCK_SIZE - size % BLOCK_SIZE, size % BLOCK_SIZE, keptBlocks - 1) != 0) return 1; // failed to write bytes
+                }
+            }
+        }
+        file.data.size = size;
+        if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+        file.dirty = true; // stored in the inode table on close or sync
+        return 0;
+    }
+
+    /**
+     * Turns compression on or off for the empty file open with the file
+     * descriptor: a compressed file stores each cluster of CLUSTER_BLOCKS
+     * blocks as an extent of fewer blocks when its data compresses
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int setCompression(int fd, bool enabled) {
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        operation op(driver);
+        openInode& file = *handle->file;
+        std::unique_lock<std::shared_mutex> inodeGuard(file.lock);
+        if (file.data.size != 0) return 1; // only an empty file can change how its data is stored
+        if (enabled) file.data.attributes |= FILE_COMPRESSED;
+        else file.data.attributes &= ~FILE_COMPRESSED;
+        file.dirty = true; // stored in the inode table on close or sync
+        return 0;
+    }
+
+    /**
+     * Reserves blocks for the given number of bytes at the given offset
+     * in the file open with the file descriptor in as few contiguous runs
+     * as possible (growing the file if needed), without writing them:
+     * reserved blocks read as zeros until written
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int fallocate(int fd, size_t offset, size_t count) {
+        STATS_TIME(TIMER_FALLOCATE);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        operation op(driver);
+        openInode& file = *handle->file;
+        std::unique_lock<std::shared_mutex> inodeGuard(file.lock);
+        if (offset > MAX_FILE_SIZE || count > MAX_FILE_SIZE - offset) return 1; // file too large, size not supported by file system
+        if (isCompressed(file)) return 1; // compressed files store each cluster in new blocks when written
+        if (count == 0) return 0;
+        int firstIndex = offset / BLOCK_SIZE;
+        int numBlocks = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE - firstIndex;
+        vector<int> blocks;
+        if (file.blockMap.resolve(firstIndex, numBlocks, blocks) != 0) return 1; // failed to resolve blocks
+        int previous = -1;
+        if (firstIndex > 0 && file.blockMap.lookup(firstIndex - 1, previous) != 0) return 1; // failed to resolve previous block
+        previous = BlockMap<G>::blockOf(previous);
+        int result = 0;
+        for (int i = 0; i < numBlocks && result == 0; i++) {
+            if (blocks[i] == -1) { // reserve the missing blocks next to the previous one
+                int missing = 1;
+                while (i + missing < numBlocks && blocks[i + missing] == -1) missing++;
+                int start;
+                int allocated = driver.allocateBlocks(previous == -1 ? -1 : previous + 1, missing, start);
+                if (allocated == 0) {
+                    result = 1; // not enough free blocks, the blocks reserved so far are kept
+                    break;
+                }
+                for (int j = 0; j < allocated; j++) {
+                    blocks[i + j] = BlockMap<G>::reserved(start + j);
+                    if (file.blockMap.assign(firstIndex + i + j, blocks[i + j]) != 0) result = 1; // failed to record block
+                }
+                i += allocated - 1;
+            }
+            previous = BlockMap<G>::blockOf(blocks[i]);
+        }
+        if (result == 0 && offset + count > (size_t) file.data.size) file.data.size = offset + count;
+        if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+        file.dirty = true; // stored in the inode table on close or sync
+        return result;
+    }
+
+    /**
+     * Moves the read head of the file descriptor
+     * to the given number of bytes from the start of the file
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int seekr(int fd, size_t count) {
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        std::lock_guard<std::mutex> guard(handle->lock);
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        if (count > (size_t) handle->file->data.size) return 1;
+        handle->readPointer = count;
+        return 0;
+    }
+
+    /**
+     * Reads the given number of bytes from the file
+     * at the file descriptor's read head into the buffer
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int read(int fd, char* buffer, size_t count) {
+        STATS_TIME(TIMER_READ);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        std::lock_guard<std::mutex> guard(handle->lock);
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        if (readAt(*handle->file, buffer, count, handle->readPointer) != 0) return 1;
+        STATS_COUNT(STAT_BYTES_READ, count);
+        handle->readPointer += count;
+        return 0;
+    }
+
+    /**
+     * Reads the given number of bytes from the file at the given offset
+     * into the buffer without moving the file descriptor's read head
+     * (concurrent calls on the same file run in parallel)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int pread(int fd, char* buffer, size_t count, size_t offset) {
+        STATS_TIME(TIMER_READ);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return 1; // invalid file descriptor
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        if (readAt(*handle->file, buffer, count, offset) != 0) return 1;
+        STATS_COUNT(STAT_BYTES_READ, count);
+        return 0;
+    }
+
+    /**
+     * Reads from the file at the file descriptor's read head into each
+     * of the iovcnt buffers in turn, all or nothing
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int readv(int fd, const struct iovec* iov, int iovcnt) {
+        STATS_TIME(TIMER_READ);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle || iovcnt < 0) return 1; // invalid file descriptor or buffer count
+        std::lock_guard<std::mutex> guard(handle->lock);
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        size_t offset = handle->readPointer, total = 0;
+        for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+        if (offset > (size_t) handle->file->data.size || total > (size_t) handle->file->data.size - offset) return 1; // reading past the end of the file
+        for (int i = 0; i < iovcnt; i++) {
+            if (readAt(*handle->file, static_cast<char*>(iov[i].iov_base), iov[i].iov_len, offset) != 0) return 1;
+            offset += iov[i].iov_len;
+        }
+        STATS_COUNT(STAT_BYTES_READ, total);
+        handle->readPointer = offset;
+        return 0;
+    }
+
+    /**
+     * Writes each of the iovcnt buffers in turn into the file
+     * at the file descriptor's write head as a single write
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int writev(int fd, const struct iovec* iov, int iovcnt) {
+        STATS_TIME(TIMER_WRITE);
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle || iovcnt < 0) return 1; // invalid file descriptor or buffer count
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(handle->lock);
+        std::unique_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        size_t offset = handle->writePointer;
+        for (int i = 0; i < iovcnt; i++) {
+            if (writeAt(*handle->file, static_cast<char*>(iov[i].iov_base), iov[i].iov_len, offset) != 0) return 1;
+            offset += iov[i].iov_len;
+        }
+        STATS_COUNT(STAT_BYTES_WRITTEN, offset - handle->writePointer);
+        handle->writePointer = offset;
+        return 0;
+    }
+
+    /**
+     * Returns read-only views of the given number of bytes of the file
+     * at the given offset without copying them into a caller buffer:
+     * spans of blocks pinned by the driver in the mapping of the image
+     * (or in its block pool with the pread backend), of a zero block
+     * for holes and of a decompressed copy for compressed files
+     * 
+     * The views never change until released: writes meanwhile go to
+     * copies of the pinned blocks and blocks freed stay until released
+     * 
+     * Returns a view handle to release them with on success and -1 on failure
+     */
+    int readViews(int fd, size_t count, size_t offset, vector<readView>& views) {
+        STATS_TIME(TIMER_READ);
+        views.clear();
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return -1; // invalid file descriptor
+        viewSet set;
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        openInode& file = *handle->file;
+        if (offset > (size_t) file.data.size || count > (size_t) file.data.size - offset) return -1; // reading past the end of the file
+        if (collectViews(file, count, offset, views, set) != 0) {
+            inodeGuard.unlock(); // operations start before taking inode locks
+            operation op(driver);
+            unpinViews(set);
+            views.clear();
+            return -1;
+        }
+        STATS_COUNT(STAT_BYTES_READ, count);
+        std::lock_guard<std::mutex> guard(viewLock);
+        int viewHandle = nextViewHandle++;
+        viewSets[viewHandle] = std::move(set);
+        return viewHandle;
+    }
+
+    /**
+     * Releases the views returned by readViews with the given handle
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int releaseViews(int viewHandle) {
+        viewSet set;
+        {
+            std::lock_guard<std::mutex> guard(viewLock);
+            auto it = viewSets.find(viewHandle);
+            if (it == viewSets.end()) return 1; // invalid view handle
+            set = std::move(it->second);
+            viewSets.erase(it);
+        }
+        operation op(driver);
+        return unpinViews(set);
+    }
+
+    /**
+     * Closes the file descriptor
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int close(int fd) {
+        STATS_TIME(TIMER_CLOSE);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::shared_ptr<openFile> handle;
+        {
+            std::unique_lock<std::shared_mutex> tableGuard(fileTableLock);
+            if (fd < 0 || fd >= (int) fileTable.size() || !fileTable[fd]) return 1; // invalid file descriptor
+            handle = fileTable[fd];
+            fileTable[fd].reset();
+        }
+        openInode& file = *handle->file;
+        std::unique_lock<std::shared_mutex> inodeGuard(file.lock);
+        int result = 0;
+        if (storeCluster(file) != 0) result = 1; // failed to store the written cluster
+        if (file.blockMap.flush() != 0) result = 1; // failed to write back indirect blocks
+        if (file.dirty) {
+            if (driver.updateInode(file.inodeNum, reinterpret_cast<char*>(&file.data)) != 0) result = 1; // failed to update inode
+            file.dirty = false;
+        }
+        if (--file.openCount == 0) openInodes.erase(file.inodeNum);
+        if (driver.flushInodes() != 0) result = 1; // failed to write back inodes
+        return result;
+    }
+
+    /**
+     * Removes a file given its path freeing its inode 
+     * and all its data blocks
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int remove(string& path) {
+        STATS_TIME(TIMER_REMOVE);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::string_view name;
+        returnInodes fetchedInodes = getInode(path, name);
+        if (fetchedInodes.inodeNum <= 0) return 1; // file not found or invalid path
+        if (openInodes.count(fetchedInodes.inodeNum) != 0) return 1; // the file needs to be closed before removing it
+        inode childInode;
+        if (driver.getInode(fetchedInodes.inodeNum, reinterpret_cast<char*>(&childInode)) != 0) return 1; // failed to read inode
+        if (childInode.flags != 0) return 1; // path is not a file
+        if (removeDirEntry(fetchedInodes.parentInodeNum, name) != 0) return 1; // could not find file in parent dir
+        vector<int> blocks;
+        if (collectBlocks(childInode, blocks) != 0) return 1; // failed to read indirect blocks
+        if (freeBlockList(blocks) != 0) return 1; // failed to free data and indirect blocks
+        if (driver.freeInode(fetchedInodes.inodeNum) != 0) return 1; // failed to free inode of file
+        return 0;
+    }
+
+    /**
+     * Creates a file at dstPath (which must not exist) sharing the data
+     * and indirect blocks of the file at srcPath, each block being copied
+     * only once either file writes to it, so files of any size clone alike
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int clone(string& srcPath, string& dstPath) {
+        STATS_TIME(TIMER_CLONE);
+        operation op(driver);
+        std::lock_guard<std::mutex> guard(namespaceLock);
+        std::string_view name;
+        int srcInodeNum = getInode(srcPath, name).inodeNum;
+        if (srcInodeNum <= 0) return 1; // file not found or invalid path
+        returnInodes fetchedInodes = getInode(dstPath, name);
+        if (fetchedInodes.inodeNum != -2) return 1; // file already exists or invalid path
+        inode fileInode;
+        std::unique_lock<std::shared_mutex> inodeGuard;
+        auto it = openInodes.find(srcInodeNum);
+        if (it != openInodes.end()) { // an open file has the latest inode and indirect blocks
+            openInode& file = *it->second;
+            inodeGuard = std::unique_lock<std::shared_mutex>(file.lock); // held until its blocks are shared
+            if (storeCluster(file) != 0) return 1; // failed to store the written cluster
+            if (file.blockMap.flush() != 0) return 1; // failed to write back indirect blocks
+            file.blockMap.reset(); // mapped indirect blocks may be shared from now on
+            fileInode = file.data;
+        } else if (driver.getInode(srcInodeNum, reinterpret_cast<char*>(&fileInode)) != 0) return 1; // failed to read inode
+        if (fileInode.flags != 0) return 1; // path is not a file
+        int inodeNum = driver.getFreeInode();
+        if (inodeNum == -1) return 1; // could not find a free inode
+        if (driver.setInode(inodeNum, reinterpret_cast<char*>(&fileInode)) != 0) return 1; // failed to write inode of new file
+        if (shareBlocks(fileInode) != 0) { // a block has too many references
+            driver.freeInode(inodeNum);
+            return 1;
+        }
+        if (addDirEntry(fetchedInodes.parentInodeNum, name, inodeNum) != 0) { // parent dir is full or name too long
+            vector<int> blocks;
+            if (collectBlocks(fileInode, blocks) == 0) freeBlockList(blocks);
+            driver.freeInode(inodeNum);
+            return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Returns the size of the file open with the given file descriptor
+     * or -1 if the file descriptor is not open
+     */
+    size_t getOpenFileSize(int fd) {
+        std::shared_ptr<openFile> handle = getFile(fd);
+        if (!handle) return -1;
+        std::shared_lock<std::shared_mutex> inodeGuard(handle->file->lock);
+        return handle->file->data.size;
+    }
+
+    /**
+     * Commits the inodes of open files and all changed metadata to the journal
+     * so they survive a crash (without writing them to their home locations)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int commit() {
+        if (storeOpenInodes() != 0) return 1;
+        return driver.commit();
+    }
+
+    /**
+     * Sets the longest time changed metadata waits before it is committed
+     */
+    void setCommitInterval(std::chrono::milliseconds interval) {
+        driver.setCommitInterval(interval);
+    }
+
+    /**
+     * Commits the inodes of open files and all changed metadata to the journal
+     * and writes all cached blocks back to the virtual disk
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int sync() {
+        STATS_TIME(TIMER_SYNC);
+        if (storeOpenInodes() != 0) return 1;
+        return driver.sync();
+    }
+
+    /**
+     * Returns the block cache hit, miss and write back counters
+     */
+    cacheStats getCacheStats() {
+        return driver.getCacheStats();
+    }
+
+    /**
+     * Returns the operation counters and latency histograms of every thread
+     * (all zero if compiled with FS_NO_STATS)
+     */
+    statsSnapshot getStats() {
+        return Stats::snapshot();
+    }
+
+    /**
+     * Prints a snapshot of the counters and histograms as JSON to out
+     * every interval (or stops printing them if the interval is 0)
+     */
+    void setStatsDump(std::chrono::milliseconds interval, std::ostream& out = std::cerr) {
+#ifndef FS_NO_STATS
+        if (interval.count() == 0) statsDumper.stop();
+        else statsDumper.start(interval, out);
+#endif
+    }
+};
+
+typedef BasicFileSystem<DefaultGeometry> FileSystem;
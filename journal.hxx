@@ -0,0 +1,308 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <string.h>
+#include "backend.hxx"
+
+using std::vector;
+using std::unordered_map;
+using std::unordered_set;
+
+#define JOURNAL_MAGIC 0x4a524e4c
+#define DESCRIPTOR_MAGIC 0x44455343
+#define COMMIT_MAGIC 0x434d4954
+
+typedef struct journalHeader_t {
+    uint32_t magic = JOURNAL_MAGIC;
+    uint32_t reserved = 0;
+    uint64_t sequence = 1; // of the first transaction in the log
+} journalHeader;
+
+typedef struct descriptorHeader_t {
+    uint32_t magic = DESCRIPTOR_MAGIC;
+    uint32_t descriptorBlocks = 0; // blocks holding this header and the block numbers
+    uint64_t sequence = 0;
+    uint32_t numBlocks = 0; // block images following the descriptor blocks
+    uint32_t numRevoked = 0; // freed blocks whose earlier images must not be replayed
+} descriptorHeader; // followed by the block numbers of the images and the revoked block numbers
+
+typedef struct commitRecord_t {
+    uint32_t magic = COMMIT_MAGIC;
+    uint32_t reserved = 0;
+    uint64_t sequence = 0;
+    uint64_t checksum = 0; // of the descriptor blocks and the block images
+} commitRecord;
+
+/**
+ * Write-ahead log of block images kept in a region of the disk
+ * made of a header block followed by transactions written one after another
+ * (descriptor blocks, block images and a commit record) until a checkpoint
+ * writes every logged block to its home location and empties the log
+ *
+ * Blocks changed since the last commit are kept here rather than in the cache
+ * and so are the blocks of the transaction being written until they are released
+ */
+class Journal {
+public:
+    typedef struct transaction_t {
+        uint64_t sequence = 0;
+        vector<int> blocks; // home locations of the images
+        vector<char> records; // descriptor blocks, block images and commit record
+        size_t imagesOffset = 0;
+    } transaction;
+private:
+    size_t blockSize = 0;
+    int start = 0; // header block of the journal region
+    int numBlocks = 0; // blocks in the region including the header
+    int head = 0; // next free block of the log
+    uint64_t sequence = 1; // of the next transaction
+    unordered_map<int, vector<char>> running; // latest images of the blocks changed since the last commit
+    unordered_map<int, vector<char>> closed; // images of the transaction being written
+    unordered_set<int> revoked; // blocks freed since the last commit that have an image in the log
+    unordered_set<int> logged; // blocks with an image in the log
+
+    static uint64_t checksum(const char* data, size_t count) { // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < count; i++) {
+            hash ^= (unsigned char) data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    int descriptorBlocks(size_t entries) const {
+        return (sizeof(descriptorHeader) + entries * sizeof(int32_t) + blockSize - 1) / blockSize;
+    }
+
+    int writeHeader(DiskBackend* disk) {
+        vector<char> block(blockSize, 0);
+        journalHeader header;
+        header.sequence = sequence;
+        memcpy(block.data(), &header, sizeof(header));
+        return disk->write(block.data(), blockSize, (size_t) start * blockSize);
+    }
+public:
+    /**
+     * Starts logging into the region of numBlocks blocks from the given block
+     */
+    void attach(size_t size, int startBlock, int regionBlocks) {
+        blockSize = size;
+        start = startBlock;
+        numBlocks = regionBlocks;
+        head = start + 1;
+        running.clear();
+        closed.clear();
+        revoked.clear();
+        logged.clear();
+    }
+
+    /**
+     * Writes an empty journal header into a region being formatted
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    static int format(DiskBackend* disk, size_t blockSize, int startBlock) {
+        Journal journal;
+        journal.attach(blockSize, startBlock, 1);
+        return journal.writeHeader(disk);
+    }
+
+    /**
+     * Copies the latest image of a block not released yet into the buffer
+     *
+     * Returns true if the block has such an image
+     */
+    bool find(int blockNum, char* buffer, size_t offset, size_t count) const {
+        auto it = running.find(blockNum);
+        if (it == running.end()) {
+            it = closed.find(blockNum);
+            if (it == closed.end()) return false;
+        }
+        memcpy(buffer, it->second.data() + offset, count);
+        return true;
+    }
+
+    /**
+     * Returns true if the block changed since the last commit
+     */
+    bool contains(int blockNum) const {
+        return running.count(blockNum) != 0;
+    }
+
+    /**
+     * Returns the image of a block in the running transaction to be changed
+     * (empty if the block has none yet, to be filled by the caller)
+     */
+    vector<char>& image(int blockNum) {
+        revoked.erase(blockNum);
+        return running[blockNum];
+    }
+
+    /**
+     * Drops the image of a freed block and keeps earlier images
+     * in the log from being replayed over its next contents
+     */
+    void revoke(int blockNum) {
+        running.erase(blockNum);
+        closed.erase(blockNum);
+        if (logged.count(blockNum) != 0) revoked.insert(blockNum);
+    }
+
+    /**
+     * Returns the number of blocks changed since the last commit
+     */
+    size_t pending() const {
+        return running.size() + revoked.size();
+    }
+
+    /**
+     * Returns the number of log blocks a transaction of the changed blocks needs
+     */
+    int transactionBlocks() const {
+        return descriptorBlocks(pending()) + running.size() + 1;
+    }
+
+    /**
+     * Returns the number of log blocks left before a checkpoint is needed
+     */
+    int freeBlocks() const {
+        return start + numBlocks - head;
+    }
+
+    /**
+     * Returns the number of log blocks of an empty journal
+     */
+    int capacity() const {
+        return numBlocks - 1;
+    }
+
+    /**
+     * Moves the blocks changed since the last commit into a transaction
+     * ready to be written at the head of the log
+     * (their images stay readable until released)
+     *
+     * Returns the first log block of the transaction
+     */
+    int close(transaction& txn) {
+        txn.sequence = sequence++;
+        txn.blocks.clear();
+        int descriptors = descriptorBlocks(pending());
+        txn.records.assign((size_t) (descriptors + running.size() + 1) * blockSize, 0);
+        txn.imagesOffset = (size_t) descriptors * blockSize;
+        descriptorHeader header;
+        header.descriptorBlocks = descriptors;
+        header.sequence = txn.sequence;
+        header.numBlocks = running.size();
+        header.numRevoked = revoked.size();
+        memcpy(txn.records.data(), &header, sizeof(header));
+        int32_t* entries = reinterpret_cast<int32_t*>(txn.records.data() + sizeof(header));
+        char* images = txn.records.data() + txn.imagesOffset;
+        for (auto& entry : running) {
+            *entries++ = entry.first;
+            memcpy(images, entry.second.data(), blockSize);
+            images += blockSize;
+            txn.blocks.push_back(entry.first);
+            logged.insert(entry.first);
+        }
+        for (int blockNum : revoked) *entries++ = blockNum;
+        commitRecord commit;
+        commit.sequence = txn.sequence;
+        commit.checksum = checksum(txn.records.data(), images - txn.records.data());
+        memcpy(images, &commit, sizeof(commit));
+        closed = std::move(running);
+        running.clear();
+        revoked.clear();
+        int first = head;
+        head += txn.records.size() / blockSize;
+        return first;
+    }
+
+    /**
+     * Applies an operation to the images of the transaction last closed
+     * that were not revoked meanwhile, stopping at the first failure, and drops them
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    template <typename F>
+    int release(F op) {
+        int result = 0;
+        for (auto& entry : closed) {
+            if (op(entry.first, entry.second) != 0) {
+                result = 1;
+                break;
+            }
+        }
+        closed.clear();
+        return result;
+    }
+
+    /**
+     * Empties the log once every logged block is at its home location
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int checkpoint(DiskBackend* disk) {
+        head = start + 1;
+        logged.clear();
+        revoked.clear();
+        return writeHeader(disk);
+    }
+
+    /**
+     * Writes the images of every complete transaction in the log to their
+     * home locations (skipping images of blocks revoked later) and empties the log
+     *
+     * Returns 0 on success and 1 on failure
+     */
+    int replay(DiskBackend* disk) {
+        vector<char> block(blockSize);
+        if (disk->read(block.data(), blockSize, (size_t) start * blockSize) != 0) return 1; // failed to read header
+        journalHeader header;
+        memcpy(&header, block.data(), sizeof(header));
+        if (header.magic != JOURNAL_MAGIC) return 1; // not a journal
+        sequence = header.sequence;
+        vector<vector<char>> found;
+        int pos = start + 1;
+        while (pos < start + numBlocks) {
+            if (disk->read(block.data(), blockSize, (size_t) pos * blockSize) != 0) return 1; // failed to read descriptor
+            descriptorHeader descriptor;
+            memcpy(&descriptor, block.data(), sizeof(descriptor));
+            if (descriptor.magic != DESCRIPTOR_MAGIC || descriptor.sequence != sequence) break; // end of the log
+            if (descriptor.descriptorBlocks != (uint32_t) descriptorBlocks(descriptor.numBlocks + descriptor.numRevoked)) break;
+            long long length = (long long) descriptor.descriptorBlocks + descriptor.numBlocks + 1;
+            if (pos + length > start + numBlocks) break; // torn descriptor
+            vector<char> records((size_t) length * blockSize);
+            if (disk->read(records.data(), records.size(), (size_t) pos * blockSize) != 0) return 1; // failed to read transaction
+            commitRecord commit;
+            memcpy(&commit, records.data() + records.size() - blockSize, sizeof(commit));
+            if (commit.magic != COMMIT_MAGIC || commit.sequence != sequence
+                || commit.checksum != checksum(records.data(), records.size() - blockSize)) break; // incomplete transaction
+            found.push_back(std::move(records));
+            pos += length;
+            sequence++;
+        }
+        // the last transaction freeing each block
+        unordered_map<int, size_t> revokedIn;
+        for (size_t t = 0; t < found.size(); t++) {
+            descriptorHeader descriptor;
+            memcpy(&descriptor, found[t].data(), sizeof(descriptor));
+            const int32_t* entries = reinterpret_cast<const int32_t*>(found[t].data() + sizeof(descriptor));
+            for (uint32_t i = 0; i < descriptor.numRevoked; i++) revokedIn[entries[descriptor.numBlocks + i]] = t;
+        }
+        for (size_t t = 0; t < found.size(); t++) {
+            descriptorHeader descriptor;
+            memcpy(&descriptor, found[t].data(), sizeof(descriptor));
+            const int32_t* entries = reinterpret_cast<const int32_t*>(found[t].data() + sizeof(descriptor));
+            const char* images = found[t].data() + (size_t) descriptor.descriptorBlocks * blockSize;
+            for (uint32_t i = 0; i < descriptor.numBlocks; i++) {
+                auto it = revokedIn.find(entries[i]);
+                if (it != revokedIn.end() && it->second >= t) continue; // freed after this image was logged
+                if (disk->write(images + (size_t) i * blockSize, blockSize, (size_t) entries[i] * blockSize) != 0) return 1; // failed to write home
+            }
+        }
+        if (!found.empty() && disk->sync() != 0) return 1;
+        return checkpoint(disk);
+    }
+};
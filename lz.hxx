@@ -0,0 +1,147 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string.h>
+
+/**
+ * Self-contained LZ77 codec of the LZ4 block format family
+ *
+ * A compressed stream is a series of sequences, each made of a token byte
+ * (literal count in the high nibble, match length minus 4 in the low nibble,
+ * 15 meaning more length bytes follow, each adding up to 255), the literals,
+ * then a 2-byte little-endian offset back into the output and the match
+ * extra length bytes; the last sequence has literals only
+ */
+class LZ {
+private:
+    static constexpr int HASH_BITS = 12;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+
+    static uint32_t read32(const uint8_t* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    /**
+     * Writes the extra bytes of a length past the 15 stored in the token
+     *
+     * Returns false if the output is full
+     */
+    static bool writeLength(uint8_t*& out, uint8_t* end, size_t length) {
+        for (; length >= 255; length -= 255) {
+            if (out == end) return false;
+            *out++ = 255;
+        }
+        if (out == end) return false;
+        *out++ = (uint8_t) length;
+        return true;
+    }
+
+    /**
+     * Reads the extra bytes of a length into length
+     *
+     * Returns false if the input ends first
+     */
+    static bool readLength(const uint8_t*& in, const uint8_t* end, size_t& length) {
+        uint8_t byte;
+        do {
+            if (in == end) return false;
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    /**
+     * Writes a sequence of literals followed by a match (none if matchLength is 0)
+     *
+     * Returns false if the output is full
+     */
+    static bool writeSequence(uint8_t*& out, uint8_t* end, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength) {
+        if (out == end) return false;
+        uint8_t* token = out++;
+        *token = (uint8_t) ((literalCount < 15 ? literalCount : 15) << 4);
+        if (literalCount >= 15 && !writeLength(out, end, literalCount - 15)) return false;
+        if ((size_t) (end - out) < literalCount) return false;
+        if (literalCount > 0) memcpy(out, literals, literalCount);
+        out += literalCount;
+        if (matchLength == 0) return true;
+        if (end - out < 2) return false;
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+        size_t extra = matchLength - MIN_MATCH;
+        *token |= (uint8_t) (extra < 15 ? extra : 15);
+        return extra < 15 || writeLength(out, end, extra - 15);
+    }
+public:
+    /**
+     * Compresses count bytes from src into at most capacity bytes of dst
+     *
+     * Returns the compressed size or 0 if it does not fit
+     */
+    static size_t compress(const char* src, size_t count, char* dst, size_t capacity) {
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        uint8_t* end = out + capacity;
+        uint32_t table[1 << HASH_BITS] = {0}; // last position + 1 of each hashed 4-byte sequence
+        size_t anchor = 0, pos = 0;
+        while (pos + MIN_MATCH <= count) {
+            uint32_t sequence = read32(in + pos);
+            uint32_t& slot = table[hash(sequence)];
+            size_t candidate = slot;
+            slot = pos + 1;
+            if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(in + candidate - 1) != sequence) {
+                pos += 1 + ((pos - anchor) >> 6); // skip faster through data that does not compress
+                continue;
+            }
+            size_t match = candidate - 1, length = MIN_MATCH;
+            while (pos + length < count && in[match + length] == in[pos + length]) length++;
+            if (!writeSequence(out, end, in + anchor, pos - anchor, pos - match, length)) return 0;
+            pos += length;
+            anchor = pos;
+        }
+        if (!writeSequence(out, end, in + anchor, count - anchor, 0, 0)) return 0;
+        return out - reinterpret_cast<uint8_t*>(dst);
+    }
+
+    /**
+     * Decompresses count bytes of src into exactly size bytes of dst
+     *
+     * Returns 0 on success and 1 on failure (a malformed stream or a size mismatch)
+     */
+    static int decompress(const char* src, size_t count, char* dst, size_t size) {
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+        const uint8_t* inEnd = in + count;
+        uint8_t* start = reinterpret_cast<uint8_t*>(dst);
+        uint8_t* out = start;
+        uint8_t* outEnd = start + size;
+        while (in < inEnd) {
+            uint8_t token = *in++;
+            size_t literalCount = token >> 4;
+            if (literalCount == 15 && !readLength(in, inEnd, literalCount)) return 1; // truncated length
+            if (literalCount > (size_t) (inEnd - in) || literalCount > (size_t) (outEnd - out)) return 1; // literals overrun
+            if (literalCount > 0) memcpy(out, in, literalCount);
+            in += literalCount;
+            out += literalCount;
+            if (in == inEnd) break; // the last sequence
+            if (inEnd - in < 2) return 1; // truncated offset
+            size_t offset = in[0] | (size_t) in[1] << 8;
+            in += 2;
+            size_t length = (token & 15);
+            if (length == 15 && !readLength(in, inEnd, length)) return 1; // truncated length
+            length += MIN_MATCH;
+            if (offset == 0 || offset > (size_t) (out - start) || length > (size_t) (outEnd - out)) return 1; // match overrun
+            const uint8_t* match = out - offset;
+            if (offset >= length) memcpy(out, match, length);
+            else for (size_t i = 0; i < length; i++) out[i] = match[i]; // overlapping copy repeats the pattern
+            out += length;
+        }
+        return out == outEnd ? 0 : 1;
+    }
+};
@@ -0,0 +1,292 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <ostream>
+#include <iomanip>
+
+/**
+ * Instrumentation of the file system counting events and timing operations
+ * in per-thread counters and latency histograms merged on snapshot
+ *
+ * Compiling with FS_NO_STATS defined turns every STATS_ macro into nothing
+ */
+
+enum statCounter {
+    STAT_LOOKUP_COMPONENTS,       // path components walked
+    STAT_DENTRY_HITS,             // path components resolved from the dentry cache
+    STAT_BYTES_READ,              // bytes read from files
+    STAT_BYTES_WRITTEN,           // bytes written to files
+    STAT_BLOCK_READS,             // single block reads (metadata and partial data)
+    STAT_METADATA_WRITES,         // metadata block updates logged to the journal
+    STAT_DATA_BLOCK_WRITES,       // partial data block updates through the cache
+    STAT_DATA_BLOCKS_READ,        // data blocks read in contiguous runs
+    STAT_DATA_BLOCKS_WRITTEN,     // data blocks written in contiguous runs
+    STAT_INDIRECT_READS,          // indirect blocks loaded by block maps
+    STAT_INDIRECT_WRITES,         // indirect blocks written back by block maps
+    STAT_BITMAP_UPDATES,          // allocations and frees of blocks and inodes
+    STAT_BITMAP_BLOCKS_WRITTEN,   // bitmap blocks logged on commit
+    STAT_GROUP_STEALS,            // block runs allocated outside the preferred allocation group
+    STAT_REFCOUNT_UPDATES,        // references added to or dropped from blocks
+    STAT_REFCOUNT_BLOCKS_WRITTEN, // reference count blocks logged on commit
+    STAT_COW_COPIES,              // shared blocks copied on write
+    STAT_COMPRESS_BYTES_IN,       // bytes of clusters stored by compressed files
+    STAT_COMPRESS_BYTES_OUT,      // bytes of the blocks those clusters were stored in
+    STAT_BLOCKS_PINNED,           // blocks pinned for read views
+    STAT_INODE_READS,             // inodes read from the inode table
+    STAT_INODE_WRITES,            // inodes stored in the inode table
+    STAT_INODE_BLOCKS_WRITTEN,    // inode table blocks logged on flush
+    STAT_JOURNAL_COMMITS,         // transactions committed
+    STAT_JOURNAL_BLOCKS_WRITTEN,  // log blocks written by commits
+    STAT_CHECKPOINTS,             // journal checkpoints
+    STAT_DISK_READS,              // reads of the image
+    STAT_DISK_READ_BYTES,
+    STAT_DISK_WRITES,             // writes of the image
+    STAT_DISK_WRITE_BYTES,
+    NUM_STAT_COUNTERS
+};
+
+enum statTimer {
+    TIMER_OPEN,
+    TIMER_CLOSE,
+    TIMER_READ,
+    TIMER_WRITE,
+    TIMER_MKDIR,
+    TIMER_RMDIR,
+    TIMER_REMOVE,
+    TIMER_READDIR,
+    TIMER_TRUNCATE,
+    TIMER_FALLOCATE,
+    TIMER_CLONE,
+    TIMER_LOOKUP,
+    TIMER_SYNC,
+    TIMER_COMMIT,
+    TIMER_DISK_READ,
+    TIMER_DISK_WRITE,
+    TIMER_DISK_SYNC,
+    NUM_STAT_TIMERS
+};
+
+static const char* const STAT_COUNTER_NAMES[NUM_STAT_COUNTERS] = {
+    "lookup_components", "dentry_hits", "bytes_read", "bytes_written",
+    "block_reads", "metadata_writes", "data_block_writes", "data_blocks_read", "data_blocks_written",
+    "indirect_reads", "indirect_writes", "bitmap_updates", "bitmap_blocks_written", "group_steals",
+    "refcount_updates", "refcount_blocks_written", "cow_copies",
+    "compress_bytes_in", "compress_bytes_out",
+    "blocks_pinned", "inode_reads", "inode_writes", "inode_blocks_written",
+    "journal_commits", "journal_blocks_written", "checkpoints",
+    "disk_reads", "disk_read_bytes", "disk_writes", "disk_write_bytes"
+};
+
+static const char* const STAT_TIMER_NAMES[NUM_STAT_TIMERS] = {
+    "open", "close", "read", "write", "mkdir", "rmdir", "remove", "readdir", "truncate", "fallocate", "clone",
+    "lookup", "sync", "commit", "disk_read", "disk_write", "disk_sync"
+};
+
+#define STATS_BUCKETS 40 // latency buckets of powers of 2 nanoseconds (the last one is open-ended)
+
+/**
+ * Latency histogram with bucket i counting latencies in [2^i, 2^(i+1)) nanoseconds
+ */
+typedef struct latencyHistogram_t {
+    uint64_t count = 0;
+    uint64_t totalNanos = 0;
+    uint64_t buckets[STATS_BUCKETS] = {0};
+
+    /**
+     * Returns the upper bound in microseconds of the bucket holding the given percentile
+     */
+    double percentile(double p) const {
+        if (count == 0) return 0;
+        uint64_t rank = std::min((uint64_t) (p / 100 * count), count - 1), seen = 0;
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen > rank) return (double) (2ULL << i) / 1000;
+        }
+        return (double) (2ULL << (STATS_BUCKETS - 1)) / 1000;
+    }
+
+    double meanMicros() const {
+        return count == 0 ? 0 : (double) totalNanos / count / 1000;
+    }
+} latencyHistogram;
+
+/**
+ * Counters and histograms of every thread merged at one point in time
+ */
+typedef struct statsSnapshot_t {
+    uint64_t counters[NUM_STAT_COUNTERS] = {0};
+    latencyHistogram timers[NUM_STAT_TIMERS];
+
+    /**
+     * Prints the snapshot as a one-line JSON object
+     * (timers never started are left out)
+     */
+    void print(std::ostream& out) const {
+        std::ios::fmtflags flags = out.flags();
+        out << std::fixed << std::setprecision(3) << "{\"counters\": {";
+        for (int i = 0; i < NUM_STAT_COUNTERS; i++) out << (i == 0 ? "" : ", ") << '"' << STAT_COUNTER_NAMES[i] << "\": " << counters[i];
+        out << "}, \"latency_us\": {";
+        bool first = true;
+        for (int i = 0; i < NUM_STAT_TIMERS; i++) {
+            const latencyHistogram& timer = timers[i];
+            if (timer.count == 0) continue;
+            out << (first ? "" : ", ") << '"' << STAT_TIMER_NAMES[i] << "\": {\"count\": " << timer.count
+                << ", \"mean\": " << timer.meanMicros() << ", \"p50\": " << timer.percentile(50)
+                << ", \"p90\": " << timer.percentile(90) << ", \"p99\": " << timer.percentile(99)
+                << ", \"max\": " << timer.percentile(100) << "}";
+            first = false;
+        }
+        out << "}}\n";
+        out.flags(flags);
+    }
+} statsSnapshot;
+
+/**
+ * Process-wide registry of the counters of every thread that recorded an event
+ *
+ * Each thread only updates its own counters (relaxed loads and stores, no shared
+ * cache lines) and a snapshot sums the counters of every thread
+ */
+class Stats {
+private:
+    typedef struct threadStats_t {
+        std::atomic<uint64_t> counters[NUM_STAT_COUNTERS];
+        std::atomic<uint64_t> timerCounts[NUM_STAT_TIMERS];
+        std::atomic<uint64_t> timerNanos[NUM_STAT_TIMERS];
+        std::atomic<uint64_t> buckets[NUM_STAT_TIMERS][STATS_BUCKETS];
+
+        threadStats_t() {
+            for (auto& counter : counters) counter.store(0, std::memory_order_relaxed);
+            for (int i = 0; i < NUM_STAT_TIMERS; i++) {
+                timerCounts[i].store(0, std::memory_order_relaxed);
+                timerNanos[i].store(0, std::memory_order_relaxed);
+                for (auto& bucket : buckets[i]) bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    } threadStats;
+
+    std::mutex registryLock;
+    std::vector<std::unique_ptr<threadStats>> threads; // kept after their thread exits
+
+    static Stats& registry() {
+        static Stats stats;
+        return stats;
+    }
+
+    static threadStats& local() {
+        thread_local threadStats* mine = nullptr;
+        if (mine == nullptr) {
+            Stats& stats = registry();
+            std::lock_guard<std::mutex> guard(stats.registryLock);
+            stats.threads.emplace_back(new threadStats());
+            mine = stats.threads.back().get();
+        }
+        return *mine;
+    }
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); // only the owner thread writes
+    }
+public:
+    static void count(statCounter counter, uint64_t n = 1) {
+        add(local().counters[counter], n);
+    }
+
+    static void record(statTimer timer, uint64_t nanos) {
+        threadStats& mine = local();
+        int bucket = std::min(63 - __builtin_clzll(nanos | 1), STATS_BUCKETS - 1);
+        add(mine.timerCounts[timer], 1);
+        add(mine.timerNanos[timer], nanos);
+        add(mine.buckets[timer][bucket], 1);
+    }
+
+    /**
+     * Returns the sum of the counters and histograms of every thread
+     */
+    static statsSnapshot snapshot() {
+        statsSnapshot result;
+        Stats& stats = registry();
+        std::lock_guard<std::mutex> guard(stats.registryLock);
+        for (auto& thread : stats.threads) {
+            for (int i = 0; i < NUM_STAT_COUNTERS; i++) result.counters[i] += thread->counters[i].load(std::memory_order_relaxed);
+            for (int i = 0; i < NUM_STAT_TIMERS; i++) {
+                result.timers[i].count += thread->timerCounts[i].load(std::memory_order_relaxed);
+                result.timers[i].totalNanos += thread->timerNanos[i].load(std::memory_order_relaxed);
+                for (int b = 0; b < STATS_BUCKETS; b++) result.timers[i].buckets[b] += thread->buckets[i][b].load(std::memory_order_relaxed);
+            }
+        }
+        return result;
+    }
+};
+
+/**
+ * Records the time from its construction to its destruction in a latency histogram
+ */
+class StatsTimer {
+private:
+    statTimer timer;
+    std::chrono::steady_clock::time_point start;
+public:
+    StatsTimer(statTimer timer) : timer(timer), start(std::chrono::steady_clock::now()) {}
+
+    ~StatsTimer() {
+        Stats::record(timer, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+/**
+ * Background thread printing a snapshot at a fixed interval
+ */
+class StatsDumper {
+private:
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable stopped;
+    bool stopping = false;
+public:
+    ~StatsDumper() {
+        stop();
+    }
+
+    /**
+     * Starts printing a snapshot to out every interval (replacing any running dump)
+     */
+    void start(std::chrono::milliseconds interval, std::ostream& out) {
+        stop();
+        stopping = false;
+        worker = std::thread([this, interval, &out]() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopped.wait_for(guard, interval, [this]() { return stopping; })) Stats::snapshot().print(out);
+        });
+    }
+
+    /**
+     * Stops printing snapshots
+     */
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        stopped.notify_all();
+        worker.join();
+    }
+};
+
+#ifdef FS_NO_STATS
+#define STATS_COUNT(counter, n) ((void) 0)
+#define STATS_TIME(timer) ((void) 0)
+#else
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_COUNT(counter, n) Stats::count(counter, n)
+#define STATS_TIME(timer) StatsTimer STATS_CONCAT(statsTimer, __LINE__)(timer)
+#endif
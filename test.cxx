@@ -0,0 +1,62 @@
+#include "fs.hxx"
+
+int main() {
+
+    FileSystem fs;
+    string path;
+    // test mkdir
+    cout << "Testing mkdir:\n";
+    path = "/home123";
+    cout << fs.mkdir(path) << '\n';
+    path = "/home123";
+    cout << fs.mkdir(path) << '\n';
+    path = "fdsgsf";
+    cout << fs.mkdir(path) << '\n';
+    path = "/home123/folder";
+    cout << fs.mkdir(path) << "\n\n";
+    // test opening and writing a file
+    cout << "Testing open:\n";
+    path = "/home123/folder/myfile1";
+    int fd = fs.open(path);
+    cout << fd << '\n';
+    // series of small writes
+    cout << "Testing write:\n";
+    for (int i = 0; i < 10; i++) {
+        cout << fs.write(fd, "hello darkness my old friend\n", 29) << '\n';
+    }
+    // series of bigger writes spanning multiple blocks and reaching single indirect and double indirect
+    for (int i = 0; i < 500; i++) {
+        cout << fs.write(fd, "goodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\ngoodbye lights my new friend\n", 290) << ' ';
+        cout << fs.write(fd, "hello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\nhello darkness my old friend\n", 290) << ' ';
+    }
+    // test getOpenFileSize
+    cout << "\nTesting getOpenFileSize:\n";
+    cout << fs.getOpenFileSize(fd) << "\n\n";
+    // test read
+    cout << "Testing read:\n";
+    char buffer[fs.getOpenFileSize(fd)];
+    cout << fs.read(fd, buffer, fs.getOpenFileSize(fd)) << "\n\n";
+    fs.close(fd);
+    fstream file;
+    file.open("myfile1-from-vdisk", ios::out | ios::binary | ios::trunc);
+    file.write(buffer, fs.getOpenFileSize(fd));
+    file.close();
+    // test remove
+    cout << "Testing remove:\n";
+    path = "/home123/folder/myfile1";
+    cout << fs.remove(path) << "\n\n";
+    // test rmdir
+    cout << "Testing rmdir:\n";
+    path = "/home123";
+    cout << fs.rmdir(path) << '\n';
+    path = "fdsgsf";
+    cout << fs.rmdir(path) << '\n';
+    path = "/home123/folder";
+    cout << fs.rmdir(path) << '\n';
+    path = "/home123";
+    cout << fs.rmdir(path) << '\n';
+    path = "/home123";
+    cout << fs.rmdir(path) << "\n\n";
+
+    return 0;
+}
\ No newline at end of file
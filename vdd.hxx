@@ -1,9 +1,24 @@
+#pragma once
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <string.h>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <limits>
+#include <type_traits>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include "cache.hxx"
+#include "bitmap.hxx"
+#include "journal.hxx"
 
 using std::cout;
 using std::vector;
@@ -12,123 +27,702 @@ using std::ios;
 using std::string;
 using std::size_t;
 
-#define BLOCK_SIZE 512 // bytes
-#define NUM_BLOCKS 4096
-#define NUM_INODES 128 // stored in blocks 2 to 9 (8 blocks / 32 bytes = 128 inodes)
-#define META_BLOCKS 10
-#define MAGIC_NUM 7428
+#define MAGIC_NUM 7432 // format with its geometry, journal, block reference counts and striping recorded in the superblock
 #define VDISK_FILE_NAME "vdisk"
-#define INODE_SIZE 32 // bytes
-
-typedef struct inode_t {
-    int size = 0;
-    int flags = 0; // 0 for file, 1 for dir
-    short direct[10] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
-    short singleIndirect = -1;
-    short doubleIndirect = -1;
-} inode;
+#define CACHE_BLOCKS 256 // default number of cached blocks
+#define DEFAULT_NUM_BLOCKS 16384 // default image size in blocks for format
+#define DEFAULT_NUM_INODES 4096 // default number of inodes for format
+#define MAX_JOURNAL_BLOCKS 4096 // journal size limit for format
+#define COMMIT_INTERVAL_MS 1000 // default time between journal commits
+#define MAX_BLOCK_SHARES UINT16_MAX // references to a block beyond the first
+#define POOL_BLOCKS 1024 // blocks kept in idle buffers of the pinned block pool
+#define FILE_COMPRESSED 1 // inode attribute of a file storing its data in compressed clusters
+#define STRIPE_BLOCKS 16 // default blocks per stripe of a volume striped over several images
+#define GROUP_BLOCKS 2048 // minimum data blocks per allocation group
+#define MAX_GROUPS 64 // allocation groups the data blocks and inodes are split into at most
 
 typedef struct dirEntry_t {
-    char inode = 0;
-    char name[31] = {0};
+    int32_t inode = 0; // 0 for an unused entry and -1 for the root dir
+    char name[60] = {0};
 } dirEntry;
 
-typedef struct dirBlock_t {
-    dirEntry entries[16];
-} dirBlock;
+/**
+ * On-disk layout of a file system with blocks of BlockSize bytes
+ * addressed by block pointers of type BlockPtr (-1 for an unallocated block)
+ *
+ * The image holds the superblock in block 0 followed by the free block bitmap,
+ * the free inode bitmap, the block reference counts, the inode table,
+ * the journal and the data blocks,
+ * with region sizes set at format and recorded in the superblock
+ *
+ * The image may be striped over several image files, stripe s of stripeBlocks
+ * blocks being stored in file s % numImages, the first holding the superblock
+ */
+template <size_t BlockSize, typename BlockPtr>
+struct Geometry {
+    static_assert(BlockSize >= 512 && BlockSize <= 65536 && (BlockSize & (BlockSize - 1)) == 0, "block size must be a power of 2 from 512 bytes to 64 KB");
+    static_assert(std::is_signed<BlockPtr>::value && sizeof(BlockPtr) >= 2 && sizeof(BlockPtr) <= sizeof(int), "block pointers must be signed integers of 16 or 32 bits");
+
+    typedef BlockPtr blockPtr;
+    static constexpr size_t BLOCK_SIZE = BlockSize; // bytes
+    static constexpr size_t INODE_SIZE = 128; // bytes
+    static constexpr int NUM_INDIRECT = 3; // single, double and triple indirect block pointers per inode
+    static constexpr int NUM_DIRECT = (INODE_SIZE - 16) / sizeof(BlockPtr) - NUM_INDIRECT; // direct block pointers per inode
+    static constexpr int NUM_POINTERS = BLOCK_SIZE / sizeof(BlockPtr); // block pointers per indirect block
+    static constexpr int DIR_ENTRIES = BLOCK_SIZE / sizeof(dirEntry); // entries per directory block
+    static constexpr int INODES_PER_BLOCK = BLOCK_SIZE / INODE_SIZE;
+    static constexpr long long MAX_BLOCKS = (long long) std::numeric_limits<BlockPtr>::max() + 1; // addressable blocks
+    static constexpr long long POINTERS = NUM_POINTERS;
+    static constexpr int MAX_FILE_BLOCKS = (int) std::min<long long>(NUM_DIRECT + POINTERS + POINTERS*POINTERS + POINTERS*POINTERS*POINTERS, INT_MAX);
+    static constexpr int CLUSTER_BLOCKS = std::max<int>(2, 65536 / BLOCK_SIZE); // blocks compressed together by compressed files
+
+    typedef struct inode_t {
+        uint64_t size = 0;
+        int32_t flags = 0; // 0 for file, 1 for dir
+        int32_t attributes = 0; // FILE_ flags
+        BlockPtr direct[NUM_DIRECT];
+        BlockPtr indirect[NUM_INDIRECT]; // single, double and triple indirect blocks
+
+        inode_t(uint64_t size = 0, int32_t flags = 0) : size(size), flags(flags) {
+            std::fill(direct, direct + NUM_DIRECT, -1);
+            std::fill(indirect, indirect + NUM_INDIRECT, -1);
+        }
+    } inode;
 
-inode DIR_INODE = {BLOCK_SIZE, 1};
+    typedef struct dirBlock_t {
+        dirEntry entries[DIR_ENTRIES];
+    } dirBlock;
 
-typedef struct indirectBlock_t {
-    short blockPointers[256] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-} indirectBlock;
+    typedef struct indirectBlock_t {
+        BlockPtr blockPointers[NUM_POINTERS];
 
-typedef struct superblock_t {
-    int magicNum = MAGIC_NUM;
-    int numBlocks = NUM_BLOCKS;
-    int numInodes = NUM_INODES;
-    char freeInodes[NUM_INODES] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
-    inode root = DIR_INODE;
-} superblock;
+        indirectBlock_t() {
+            std::fill(blockPointers, blockPointers + NUM_POINTERS, -1);
+        }
+    } indirectBlock;
+
+    typedef struct superblock_t {
+        uint32_t magicNum = MAGIC_NUM;
+        uint32_t blockSize = BLOCK_SIZE;
+        uint32_t pointerSize = sizeof(BlockPtr);
+        uint32_t inodeSize = INODE_SIZE;
+        int32_t numBlocks = 0;
+        int32_t numInodes = 0;
+        int32_t freeBlocksStart = 0; // first block of the free block bitmap
+        int32_t freeInodesStart = 0; // first block of the free inode bitmap
+        int32_t sharesStart = 0; // first block of the 16-bit counts of references to each block beyond the first
+        int32_t inodeTableStart = 0; // first block of the inode table (inode 1 onwards)
+        int32_t journalStart = 0; // header block of the journal
+        int32_t journalBlocks = 0; // blocks in the journal including the header
+        int32_t dataStart = 0; // first data block (the root dir block)
+        int32_t numImages = 1; // image files the blocks are striped over
+        int32_t stripeBlocks = 0; // blocks per stripe (0 if not striped)
+        inode root = inode(BLOCK_SIZE, 1);
+    } superblock;
+
+    static_assert(sizeof(inode) == INODE_SIZE, "inodes must fill their slot in the inode table");
+    static_assert(sizeof(dirBlock) == BLOCK_SIZE && sizeof(indirectBlock) == BLOCK_SIZE && sizeof(superblock) <= BLOCK_SIZE, "blocks must fill a disk block");
+};
 
-typedef struct freeblock_t {
-    unsigned char free[NUM_BLOCKS/8];
-} freeblock;
+typedef Geometry<4096, int32_t> DefaultGeometry;
 
+template <typename G>
 class VDiskDriver {
+public:
+    typedef typename G::inode inode;
+    typedef typename G::dirBlock dirBlock;
+    typedef typename G::superblock superblock;
+    static constexpr size_t BLOCK_SIZE = G::BLOCK_SIZE;
+    static constexpr size_t INODE_SIZE = G::INODE_SIZE;
+    static constexpr int INODES_PER_BLOCK = G::INODES_PER_BLOCK;
+    static constexpr int SHARES_PER_BLOCK = BLOCK_SIZE / sizeof(uint16_t);
 private:
-    fstream disk;
-    vector<int> freeBlocks;
-    vector<int> freeInodes;
-    int freeBlockClock;
+    BackendType backendType;
+    vector<string> imagePaths; // image files the blocks are striped over
+    std::unique_ptr<DiskBackend> disk;
+    BlockCache cache;
+    Bitmap freeBlocks;
+    Bitmap freeInodes;
+    Bitmap freeBlocksDirty; // blocks of the free block bitmap changed since the last commit
+    Bitmap freeInodesDirty; // blocks of the free inode bitmap changed since the last commit
+    vector<uint16_t> blockShares; // references to each block beyond the first (0 for unshared and free blocks)
+    Bitmap blockSharesDirty; // blocks of the reference counts changed since the last commit
+    vector<uint16_t> blockPins; // pins of each block in the mapping of the image
+    Bitmap freedWhilePinned; // pinned blocks freed meanwhile, freed once unpinned
+    vector<std::pair<size_t, std::unique_ptr<char[]>>> idleBuffers; // pinned block pool buffers not lent and their sizes in blocks
+    unordered_map<const char*, std::pair<size_t, std::unique_ptr<char[]>>> lentBuffers; // pool buffers holding pinned blocks
+    /**
+     * Slice of the data blocks and the inodes allocated from together,
+     * each thread allocating from its own group first
+     */
+    typedef struct allocGroup_t {
+        int firstBlock; // data blocks [firstBlock, endBlock)
+        int endBlock;
+        int firstInode; // inodes [firstInode, endInode)
+        int endInode;
+        int freeBlocks;
+        int freeInodes;
+        int clock; // block to look for free blocks from without a goal
+    } allocGroup;
+
+    vector<allocGroup> groups; // allocation groups of the mounted image
+    superblock super; // layout of the mounted image
+    vector<inode> inodeTable; // root inode at 0 followed by the numbered inodes
+    Bitmap dirtyInodes; // inodes changed since they were last written to the table
+    std::chrono::milliseconds inodeFlushInterval{0};
+    std::chrono::steady_clock::time_point lastInodeFlush;
+    Journal journal; // metadata blocks changed since the last commit and the log on disk
+    int activeOps = 0; // operations whose changes are not complete yet
+    bool closing = false; // a commit waits for the active operations to finish
+    bool committing = false; // a commit is being written
+    std::chrono::milliseconds commitInterval{COMMIT_INTERVAL_MS};
+    std::chrono::steady_clock::time_point lastCommit;
+    std::condition_variable_any opsChanged;
+    std::recursive_mutex driverLock; // guards the cache, the journal, the bitmaps and the inode table
+
+    std::unique_ptr<DiskBackend> makeImage() {
+        if (backendType == BACKEND_MMAP)
+            return std::unique_ptr<DiskBackend>(new MmapBackend());
+        return std::unique_ptr<DiskBackend>(new FdBackend());
+    }
+
+    /**
+     * Returns the backend of a disk laid out as the given superblock records
+     * (striped over the image files if there are several)
+     */
+    std::unique_ptr<DiskBackend> makeBackend(const superblock& layout) {
+        if (layout.numImages == 1) return makeImage();
+        vector<std::unique_ptr<DiskBackend>> images;
+        for (int i = 0; i < layout.numImages; i++) images.push_back(makeImage());
+        return std::unique_ptr<DiskBackend>(new StripedBackend(std::move(images), imagePaths, (size_t) layout.stripeBlocks * BLOCK_SIZE));
+    }
+
+    /**
+     * Writes the changed blocks of the in-memory free block
+     * and free inode bitmaps and block reference counts into the journal
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int flushBitmaps() {
+        if (writeBitmap(freeBlocks, freeBlocksDirty, super.freeBlocksStart) != 0) return 1;
+        if (writeBitmap(freeInodes, freeInodesDirty, super.freeInodesStart) != 0) return 1;
+        long i = blockSharesDirty.findSet(0, blockSharesDirty.size());
+        while (i != -1) {
+            if (logWrite(reinterpret_cast<char*>(&blockShares[i * SHARES_PER_BLOCK]), super.sharesStart + i, 0, BLOCK_SIZE) != 0) return 1;
+            STATS_COUNT(STAT_REFCOUNT_BLOCKS_WRITTEN, 1);
+            blockSharesDirty.clear(i);
+            i = blockSharesDirty.findSet(i + 1, blockSharesDirty.size());
+        }
+        return 0;
+    }
+
+    static int bitmapBlocks(long long bits) {
+        return (bits + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE);
+    }
+
+    static int shareBlocks(long long numBlocks) {
+        return (numBlocks + SHARES_PER_BLOCK - 1) / SHARES_PER_BLOCK;
+    }
+
+    /**
+     * Adds delta to the count of references to a block beyond the first
+     * (written back on commit)
+     */
+    void changeShares(int blockNum, int delta) {
+        STATS_COUNT(STAT_REFCOUNT_UPDATES, 1);
+        blockShares[blockNum] += delta;
+        blockSharesDirty.set(blockNum / SHARES_PER_BLOCK);
+    }
+
+    /**
+     * Frees count unshared blocks starting from the specified block number
+     * (pinned blocks are only freed once unpinned)
+     */
+    void releaseBlocks(int startBlock, int count) {
+        int runStart = startBlock;
+        for (int blockNum = startBlock; blockNum <= startBlock + count; blockNum++) {
+            if (blockNum < startBlock + count && blockPins[blockNum] == 0) continue;
+            if (blockNum > runStart) {
+                STATS_COUNT(STAT_BITMAP_UPDATES, 1);
+                freeBlocks.setRange(runStart, blockNum - runStart);
+                markBitmapDirty(freeBlocksDirty, runStart, blockNum - runStart);
+                countFreeBlocks(runStart, blockNum - runStart, 1);
+                cache.discard(runStart, blockNum - runStart);
+                for (int i = runStart; i < blockNum; i++) journal.revoke(i);
+            }
+            if (blockNum < startBlock + count) freedWhilePinned.set(blockNum);
+            runStart = blockNum + 1;
+        }
+    }
+
+    /**
+     * Splits the data blocks and the inodes into allocation groups
+     * counting the free ones of each group
+     */
+    void makeGroups() {
+        int dataBlocks = super.numBlocks - super.dataStart;
+        int groupBlocks = std::max(GROUP_BLOCKS, (dataBlocks + MAX_GROUPS - 1) / MAX_GROUPS);
+        int numGroups = (dataBlocks + groupBlocks - 1) / groupBlocks;
+        int groupInodes = (super.numInodes + numGroups - 1) / numGroups;
+        groups.resize(numGroups);
+        for (int g = 0; g < numGroups; g++) {
+            allocGroup& group = groups[g];
+            group.firstBlock = super.dataStart + g * groupBlocks;
+            group.endBlock = std::min(group.firstBlock + groupBlocks, super.numBlocks);
+            group.firstInode = std::min(1 + g * groupInodes, super.numInodes + 1);
+            group.endInode = std::min(group.firstInode + groupInodes, super.numInodes + 1);
+            group.freeBlocks = freeBlocks.countRange(group.firstBlock, group.endBlock - group.firstBlock);
+            group.freeInodes = freeInodes.countRange(group.firstInode, group.endInode - group.firstInode);
+            group.clock = group.firstBlock;
+        }
+    }
+
+    int groupOfBlock(int blockNum) {
+        return (blockNum - super.dataStart) / (groups[0].endBlock - groups[0].firstBlock);
+    }
+
+    int groupOfInode(int inodeNum) {
+        return (inodeNum - 1) / (groups[0].endInode - groups[0].firstInode);
+    }
+
+    /**
+     * Adds delta to the free block counts of the groups of count blocks
+     * starting from the specified block number
+     */
+    void countFreeBlocks(int startBlock, int count, int delta) {
+        int end = startBlock + count;
+        startBlock = std::max(startBlock, super.dataStart); // metadata blocks are in no group
+        while (startBlock < end) {
+            allocGroup& group = groups[groupOfBlock(startBlock)];
+            int n = std::min(end, group.endBlock) - startBlock;
+            group.freeBlocks += delta * n;
+            startBlock += n;
+        }
+    }
+
+    /**
+     * Returns the group the calling thread allocates from first,
+     * threads being spread evenly over the groups in the order they first allocate
+     */
+    int homeGroup() {
+        static std::atomic<int> threads(0);
+        thread_local int thread = threads++;
+        double spread = std::fmod(thread * 0.6180339887498949, 1.0); // golden ratio steps fill the gaps between earlier threads
+        return std::min((int) (spread * groups.size()), (int) groups.size() - 1);
+    }
+
+    /**
+     * Looks for a run of up to maxCount free blocks of a group
+     * from the goal block to the end of the group then from its start,
+     * replacing the best run found so far if longer
+     * 
+     * Returns true once a run of maxCount blocks is found
+     */
+    bool findRun(const allocGroup& group, int goal, int maxCount, long& bestStart, long& bestLength) {
+        if (group.freeBlocks <= bestLength) return false; // no longer run in this group
+        long pos = goal;
+        bool wrapped = false;
+        while (true) {
+            long runStart = freeBlocks.findSet(pos, wrapped ? goal : group.endBlock);
+            if (runStart == -1) {
+                if (wrapped || goal == group.firstBlock) return false;
+                wrapped = true;
+                pos = group.firstBlock;
+                continue;
+            }
+            long runEnd = freeBlocks.findClear(runStart, std::min((long) group.endBlock, runStart + maxCount));
+            if (runEnd == -1) runEnd = std::min((long) group.endBlock, runStart + maxCount);
+            if (runEnd - runStart > bestLength) {
+                bestStart = runStart;
+                bestLength = runEnd - runStart;
+                if (bestLength == maxCount) return true;
+            }
+            pos = runEnd;
+        }
+    }
+
+    /**
+     * Drops a pin of count blocks starting from the specified block number
+     * freeing the blocks freed while pinned that are no longer pinned
+     */
+    void unpin(int startBlock, int count) {
+        for (int blockNum = startBlock; blockNum < startBlock + count; blockNum++) {
+            if (--blockPins[blockNum] == 0 && freedWhilePinned.test(blockNum)) {
+                freedWhilePinned.clear(blockNum);
+                releaseBlocks(blockNum, 1);
+            }
+        }
+    }
+
+    /**
+     * Writes the blocks of a bitmap marked in dirtyBlocks into the journal
+     * (the bitmap is stored in the blocks starting from startBlock)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int writeBitmap(Bitmap& bitmap, Bitmap& dirtyBlocks, int startBlock) {
+        vector<unsigned char> bytes(BLOCK_SIZE);
+        long i = dirtyBlocks.findSet(0, dirtyBlocks.size());
+        while (i != -1) {
+            bitmap.storeBytes(bytes.data(), (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+            if (logWrite(reinterpret_cast<char*>(bytes.data()), startBlock + i, 0, BLOCK_SIZE) != 0) return 1;
+            STATS_COUNT(STAT_BITMAP_BLOCKS_WRITTEN, 1);
+            dirtyBlocks.clear(i);
+            i = dirtyBlocks.findSet(i + 1, dirtyBlocks.size());
+        }
+        return 0;
+    }
+
+    /**
+     * Marks the blocks of a bitmap holding the bits [firstBit, firstBit + count) as changed
+     */
+    static void markBitmapDirty(Bitmap& dirtyBlocks, size_t firstBit, size_t count) {
+        size_t first = firstBit / (8 * BLOCK_SIZE);
+        dirtyBlocks.setRange(first, (firstBit + count - 1) / (8 * BLOCK_SIZE) - first + 1);
+    }
+
+    /**
+     * Writes count bytes from the buffer at the given offset in a metadata block
+     * into the running transaction of the journal
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int logWrite(const char* buffer, int blockNum, size_t offset, size_t count) {
+        if (offset + count > BLOCK_SIZE) return 1;
+        STATS_COUNT(STAT_METADATA_WRITES, 1);
+        if (!journal.contains(blockNum)) {
+            vector<char> block(BLOCK_SIZE);
+            // a partly written block starts from its latest contents
+            if (count < BLOCK_SIZE && !journal.find(blockNum, block.data(), 0, BLOCK_SIZE)
+                && cache.read(block.data(), blockNum, 0, BLOCK_SIZE) != 0) return 1; // failed to read block
+            journal.image(blockNum) = std::move(block);
+        }
+        memcpy(journal.image(blockNum).data() + offset, buffer, count);
+        return 0;
+    }
+
+    /**
+     * Writes every committed block to its home location and empties the journal
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int checkpoint() {
+        STATS_COUNT(STAT_CHECKPOINTS, 1);
+        if (cache.flush() != 0) return 1; // failed to write back cached blocks
+        if (disk->sync() != 0) return 1; // failed to flush home locations
+        return journal.checkpoint(disk.get());
+    }
+
+    /**
+     * Reads a bitmap of the given number of bits stored from startBlock on the disk
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int readBitmap(Bitmap& bitmap, size_t bits, int startBlock) {
+        vector<unsigned char> bytes((size_t) bitmapBlocks(bits) * BLOCK_SIZE);
+        if (disk->read(reinterpret_cast<char*>(bytes.data()), bytes.size(), (size_t) startBlock * BLOCK_SIZE) != 0) return 1;
+        bitmap.resize(bits);
+        bitmap.loadBytes(bytes.data());
+        return 0;
+    }
+
+    /**
+     * Marks an inode of the in-memory table as changed flushing the table
+     * if the flush interval has passed since the last flush
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int markInodeDirty(int inodeNum) {
+        dirtyInodes.set(inodeNum == -1 ? 0 : inodeNum);
+        if (inodeFlushInterval.count() > 0 && std::chrono::steady_clock::now() - lastInodeFlush >= inodeFlushInterval) return flushInodes();
+        return 0;
+    }
 public:
-    VDiskDriver() {
-        freeInodes.push_back(-1); // inode 0 is not valid
-        freeBlockClock = 0;
+    /**
+     * Driver of the disk stored in the given image files
+     * (several for blocks striped over them, the first holding the superblock)
+     */
+    VDiskDriver(BackendType backendType = BACKEND_PREAD, size_t cacheBlocks = CACHE_BLOCKS, const vector<string>& images = {VDISK_FILE_NAME})
+        : backendType(backendType), imagePaths(images), cache(cacheBlocks, BLOCK_SIZE) {}
+
+    ~VDiskDriver() {
+        unmount();
     }
 
     /**
-     * Mounts the virtual disk file if matching format
+     * Mounts the virtual disk files if matching format
+     * keeping them open until unmounted
      * 
      * Returns 0 on success and 1 on failure
      */
     int mount() {
-        disk.open(VDISK_FILE_NAME, ios::in | ios::binary);
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (disk) return 1; // already mounted
+        if (imagePaths.empty()) return 1; // no image files
+        disk = makeImage();
+        if (disk->open(imagePaths[0].c_str()) != 0) {
+            disk.reset();
+            return 1; // failed to open the virtual disk file
+        }
         // read the superblock
-        superblock super;
-        disk.read(reinterpret_cast<char*>(&super), sizeof(superblock));
-        // if the magic number does not match the mount fails
-        if (super.magicNum != MAGIC_NUM) return 1;
-        // read the free inodes array
-        for (int i = 0; i < NUM_INODES; i++)
-            freeInodes.push_back(super.freeInodes[i]);
-        // read the freeblock
-        disk.seekg(BLOCK_SIZE);
-        freeblock free;
-        disk.read(reinterpret_cast<char*>(&free), 512);
-        // store the freeblock bits in the free vector
-        for (int i = 0; i < NUM_BLOCKS/8; i++)
-            for (int j = 7; j >= 0; j--)
-                freeBlocks.push_back((free.free[i] & (1 << j)) >> j);
-        if (disk.bad()) return 1;
-        disk.close();
+        // if the magic number or the geometry does not match the mount fails
+        if (disk->read(reinterpret_cast<char*>(&super), sizeof(superblock), 0) != 0 || super.magicNum != MAGIC_NUM
+            || super.blockSize != BLOCK_SIZE || super.pointerSize != sizeof(typename G::blockPtr) || super.inodeSize != INODE_SIZE
+            || super.numInodes <= 0 || super.sharesStart <= 0 || super.dataStart <= 0 || super.dataStart >= super.numBlocks
+            || super.journalStart <= 0 || super.journalBlocks < 2 || super.journalStart + super.journalBlocks > super.dataStart
+            || super.numImages != (int32_t) imagePaths.size() || (super.numImages > 1 && super.stripeBlocks <= 0)) {
+            disk.reset();
+            return 1;
+        }
+        // the first stripe holding the superblock is at the start of the first image
+        // so reopen it with the others once the striping is known
+        if (super.numImages > 1) {
+            disk->close();
+            disk = makeBackend(super);
+            if (disk->open(imagePaths[0].c_str()) != 0) {
+                disk.reset();
+                return 1; // failed to open the image files
+            }
+        }
+        // replay the transactions committed before the image was last closed
+        // and read the superblock again in case the replay changed the root inode
+        journal.attach(BLOCK_SIZE, super.journalStart, super.journalBlocks);
+        if (journal.replay(disk.get()) != 0 || disk->read(reinterpret_cast<char*>(&super), sizeof(superblock), 0) != 0) {
+            disk.reset();
+            return 1;
+        }
+        // read the free inode and free block bitmaps (inode 0 is not valid)
+        if (readBitmap(freeInodes, super.numInodes + 1, super.freeInodesStart) != 0 || readBitmap(freeBlocks, super.numBlocks, super.freeBlocksStart) != 0) {
+            disk.reset();
+            return 1;
+        }
+        // read the block reference counts
+        blockShares.assign((size_t) shareBlocks(super.numBlocks) * SHARES_PER_BLOCK, 0);
+        if (disk->read(reinterpret_cast<char*>(blockShares.data()), blockShares.size() * sizeof(uint16_t), (size_t) super.sharesStart * BLOCK_SIZE) != 0) {
+            disk.reset();
+            return 1;
+        }
+        // load the whole inode table with a single read
+        inodeTable.resize(super.numInodes + 1);
+        inodeTable[0] = super.root;
+        if (disk->read(reinterpret_cast<char*>(&inodeTable[1]), (size_t) super.numInodes * INODE_SIZE, (size_t) super.inodeTableStart * BLOCK_SIZE) != 0) {
+            disk.reset();
+            return 1;
+        }
+        dirtyInodes.resize(super.numInodes + 1);
+        freeBlocksDirty.resize(bitmapBlocks(super.numBlocks));
+        freeInodesDirty.resize(bitmapBlocks(super.numInodes + 1));
+        blockSharesDirty.resize(shareBlocks(super.numBlocks));
+        blockPins.assign(super.numBlocks, 0);
+        freedWhilePinned.resize(super.numBlocks);
+        makeGroups();
+        lastInodeFlush = lastCommit = std::chrono::steady_clock::now();
+        cache.attach(disk.get());
         return 0;
     }
 
     /**
-     * Initializes a formatted virtual disk file
+     * Commits the changed metadata, writes back all cached blocks
+     * to their home locations and flushes the virtual disk file
+     * (must not be called within an operation)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int sync() {
+        if (commit() != 0) return 1; // failed to commit
+        std::unique_lock<std::recursive_mutex> guard(driverLock);
+        while (committing) opsChanged.wait(guard);
+        if (!disk) return 1; // not mounted
+        return checkpoint();
+    }
+
+    /**
+     * Writes back all cached blocks and closes the virtual disk file
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int unmount() {
+        int result = sync();
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (!disk) return 1; // not mounted
+        cache.detach();
+        result |= disk->close();
+        disk.reset();
+        freeBlocks.resize(0);
+        freeInodes.resize(0);
+        inodeTable.clear();
+        dirtyInodes.resize(0);
+        freeBlocksDirty.resize(0);
+        freeInodesDirty.resize(0);
+        blockShares.clear();
+        blockSharesDirty.resize(0);
+        blockPins.clear();
+        freedWhilePinned.resize(0);
+        groups.clear();
+        return result;
+    }
+
+    /**
+     * Writes the metadata changed by the completed operations to the journal
+     * as one transaction, waiting for the active operations to finish first
+     * (operations starting meanwhile wait and join the next transaction)
+     * 
+     * The transaction is written and flushed with a single disk sync outside
+     * the driver lock so operations go on meanwhile, and its blocks are written
+     * back to their home locations through the cache only once it is durable
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int commit() {
+        STATS_TIME(TIMER_COMMIT);
+        std::unique_lock<std::recursive_mutex> guard(driverLock);
+        while (committing) opsChanged.wait(guard); // one commit at a time
+        if (!disk) return 1; // not mounted
+        committing = closing = true;
+        while (activeOps > 0) opsChanged.wait(guard);
+        int result = flushInodes() | flushBitmaps();
+        closing = false;
+        opsChanged.notify_all();
+        if (result == 0 && journal.pending() > 0) {
+            if (journal.transactionBlocks() > journal.freeBlocks()) result |= checkpoint(); // the log is full
+            Journal::transaction txn;
+            bool inPlace = journal.transactionBlocks() > journal.capacity();
+            if (inPlace) {
+                // too large for the log, written back in place without the atomicity of a transaction
+                journal.close(txn);
+            } else {
+                int first = journal.close(txn);
+                STATS_COUNT(STAT_JOURNAL_COMMITS, 1);
+                STATS_COUNT(STAT_JOURNAL_BLOCKS_WRITTEN, txn.records.size() / BLOCK_SIZE);
+                guard.unlock();
+                result |= disk->write(txn.records.data(), txn.records.size(), (size_t) first * BLOCK_SIZE);
+                result |= disk->sync();
+                guard.lock();
+            }
+            // blocks freed since the transaction was closed are dropped from it
+            result |= journal.release([&](int blockNum, const vector<char>& image) {
+                return cache.write(image.data(), blockNum, 0, BLOCK_SIZE);
+            });
+            if (inPlace) result |= checkpoint();
+        }
+        lastCommit = std::chrono::steady_clock::now();
+        committing = false;
+        opsChanged.notify_all();
+        return result;
+    }
+
+    /**
+     * Sets the longest time between journal commits
+     * (a commit also starts once the running transaction fills a quarter of the journal)
+     */
+    void setCommitInterval(std::chrono::milliseconds interval) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        commitInterval = interval;
+    }
+
+    /**
+     * Marks the start of an operation whose metadata changes
+     * must be committed in the same transaction
+     */
+    void beginOperation() {
+        std::unique_lock<std::recursive_mutex> guard(driverLock);
+        while (closing) opsChanged.wait(guard);
+        activeOps++;
+    }
+
+    /**
+     * Marks the end of an operation committing the running transaction
+     * if it is large or old enough
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int endOperation() {
+        {
+            std::lock_guard<std::recursive_mutex> guard(driverLock);
+            if (--activeOps == 0) opsChanged.notify_all();
+            if (!disk || committing) return 0;
+            if (journal.pending() < (size_t) journal.capacity() / 4
+                && std::chrono::steady_clock::now() - lastCommit < commitInterval) return 0;
+        }
+        return commit();
+    }
+
+    /**
+     * Scope of an operation from beginOperation to endOperation
+     * (started before taking any lock that running operations may wait for)
+     */
+    class operation {
+    private:
+        VDiskDriver& driver;
+    public:
+        operation(VDiskDriver& vdisk) : driver(vdisk) {
+            driver.beginOperation();
+        }
+
+        ~operation() {
+            driver.endOperation();
+        }
+    };
+
+    /**
+     * Initializes formatted virtual disk files of numBlocks blocks
+     * with numInodes inodes, striped over the image files
+     * in stripes of stripeBlocks blocks if there are several
      * 
      * Returns 0 on success and 1 on failure
      */
-    int format() {
-        disk.open(VDISK_FILE_NAME, ios::out | ios::binary | ios::trunc);
+    int format(long long numBlocks = DEFAULT_NUM_BLOCKS, long long numInodes = DEFAULT_NUM_INODES, int stripeBlocks = STRIPE_BLOCKS) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (disk) return 1; // cannot format a mounted disk
+        if (numBlocks <= 0 || numBlocks > G::MAX_BLOCKS || numBlocks > INT_MAX || numInodes <= 0 || numInodes >= INT_MAX) return 1; // not addressable
+        if (imagePaths.empty() || imagePaths.size() > INT_MAX || (imagePaths.size() > 1 && stripeBlocks <= 0)) return 1; // no valid striping
+        // lay out the metadata regions after the superblock
+        superblock layout;
+        layout.numBlocks = numBlocks;
+        layout.numInodes = numInodes;
+        layout.freeBlocksStart = 1;
+        layout.freeInodesStart = layout.freeBlocksStart + bitmapBlocks(numBlocks);
+        layout.sharesStart = layout.freeInodesStart + bitmapBlocks(numInodes + 1);
+        layout.inodeTableStart = layout.sharesStart + shareBlocks(numBlocks);
+        long long journalStart = layout.inodeTableStart + (numInodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+        long long journalBlocks = std::max(std::min(numBlocks / 16, (long long) MAX_JOURNAL_BLOCKS), 16LL);
+        long long dataStart = journalStart + journalBlocks;
+        if (dataStart >= numBlocks) return 1; // no room for data blocks
+        layout.journalStart = journalStart;
+        layout.journalBlocks = journalBlocks;
+        layout.dataStart = dataStart;
+        layout.root.direct[0] = dataStart;
+        layout.numImages = imagePaths.size();
+        layout.stripeBlocks = layout.numImages > 1 ? stripeBlocks : 0;
+        std::unique_ptr<DiskBackend> image = makeBackend(layout);
+        if (image->create(imagePaths[0].c_str(), (size_t) numBlocks * BLOCK_SIZE) != 0) return 1;
         // write the superblock
-        superblock super;
-        super.root.direct[0] = 10;
-        disk.write(reinterpret_cast<char*>(&super), BLOCK_SIZE);
-        // write the freeblock
-        freeblock free;
-        free.free[0] = 0b00000000;
-        free.free[1] = 0b00011111;
-        for (int i = 2; i < BLOCK_SIZE; i++)
-            free.free[i] = 0b11111111;
-        disk.write(reinterpret_cast<char*>(&free), BLOCK_SIZE);
-        // write the rest of the metablocks
-        for (int i = 2; i < META_BLOCKS; i++)
-            disk.write("x", BLOCK_SIZE);
-        // write the root directory block (10)
+        vector<char> block(BLOCK_SIZE, 0);
+        memcpy(block.data(), &layout, sizeof(superblock));
+        if (image->write(block.data(), BLOCK_SIZE, 0) != 0) return 1;
+        // write the free block bitmap (every block after the root dir block is free)
+        Bitmap free(numBlocks);
+        free.setRange(dataStart + 1, numBlocks - dataStart - 1);
+        vector<unsigned char> bytes((size_t) bitmapBlocks(numBlocks) * BLOCK_SIZE, 0);
+        free.storeBytes(bytes.data());
+        if (image->write(reinterpret_cast<char*>(bytes.data()), bytes.size(), (size_t) layout.freeBlocksStart * BLOCK_SIZE) != 0) return 1;
+        // write the free inode bitmap (every inode but the invalid inode 0 is free)
+        free.resize(numInodes + 1);
+        free.setRange(1, numInodes);
+        bytes.assign((size_t) bitmapBlocks(numInodes + 1) * BLOCK_SIZE, 0);
+        free.storeBytes(bytes.data());
+        if (image->write(reinterpret_cast<char*>(bytes.data()), bytes.size(), (size_t) layout.freeInodesStart * BLOCK_SIZE) != 0) return 1;
+        // the reference counts and the inode table are already zeroed
+        if (Journal::format(image.get(), BLOCK_SIZE, journalStart) != 0) return 1;
+        // write the root directory block
         dirBlock root;
         root.entries[0].inode = -1;
         strcpy(root.entries[0].name, ".");
         root.entries[1].inode = -1;
         strcpy(root.entries[1].name, "..");
-        disk.write(reinterpret_cast<char*>(&root), BLOCK_SIZE);
-        // write the rest of the blocks
-        for (int i = META_BLOCKS + 1; i < NUM_BLOCKS; i++)
-            disk.write("x", BLOCK_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        if (image->write(reinterpret_cast<char*>(&root), BLOCK_SIZE, (size_t) dataStart * BLOCK_SIZE) != 0) return 1;
+        if (image->sync() != 0) return 1;
+        return image->close();
     }
 
     /**
@@ -138,17 +732,15 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int readBlock(char* buffer, int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         // block number out of range
-        if (blockNum < 0 || blockNum >= NUM_BLOCKS) return 1;
+        if (blockNum < 0 || blockNum >= super.numBlocks) return 1;
         // attempting to read a block that is free
-        if (freeBlocks[blockNum] == 1) return 1;
-        // read the specified block
-        disk.open(VDISK_FILE_NAME, ios::in | ios::binary);
-        disk.seekg(blockNum * BLOCK_SIZE);
-        disk.read(buffer, BLOCK_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        if (freeBlocks.test(blockNum)) return 1;
+        // read the specified block (metadata changed since the last commit is in the journal)
+        STATS_COUNT(STAT_BLOCK_READS, 1);
+        if (journal.find(blockNum, buffer, 0, BLOCK_SIZE)) return 0;
+        return cache.read(buffer, blockNum, 0, BLOCK_SIZE);
     }
 
     /**
@@ -158,88 +750,310 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int writeBlock(char* buffer, int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         // block number out of range
-        if (blockNum < 0 || blockNum >= NUM_BLOCKS) return 1;
+        if (blockNum < 0 || blockNum >= super.numBlocks) return 1;
         // attempting to write a block that is not free
-        if (freeBlocks[blockNum] == 0) return 1;
-        // write the specified block 
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(blockNum * BLOCK_SIZE);
-        disk.write(buffer, BLOCK_SIZE);
-        // update the block to not free in vector then on free block
-        freeBlocks[blockNum] = 0;
-        disk.seekg(BLOCK_SIZE + blockNum/8);
-        char byte[1];
-        disk.read(byte, 1);
-        byte[0] &= ~(1 << (7 - blockNum % 8));
-        disk.seekp(BLOCK_SIZE + blockNum/8);
-        disk.write(byte, 1);
-        if (disk.bad()) return 1;
-        disk.close();
+        if (!freeBlocks.test(blockNum)) return 1;
+        // write the specified block into the journal
+        if (logWrite(buffer, blockNum, 0, BLOCK_SIZE) != 0) return 1;
+        // update the block to not free in the bitmap (written back on commit)
+        STATS_COUNT(STAT_BITMAP_UPDATES, 1);
+        freeBlocks.clear(blockNum);
+        markBitmapDirty(freeBlocksDirty, blockNum, 1);
+        countFreeBlocks(blockNum, 1, -1);
         return 0;
     }
 
     /**
-     * Updates the block with specified block number 
-     * with the contents in input byte buffer 
+     * Updates the metadata block with specified block number 
+     * with the contents in input byte buffer through the journal
      * 
      * Returns 0 on success and 1 on failure
      */
     int updateBlock(char* buffer, int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         // block number out of range
-        if (blockNum < 0 || blockNum >= NUM_BLOCKS) return 1;
+        if (blockNum < 0 || blockNum >= super.numBlocks) return 1;
         // attempting to update a block that is free
-        if (freeBlocks[blockNum] == 1) return 1;
+        if (freeBlocks.test(blockNum)) return 1;
         // update the specified block 
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(blockNum * BLOCK_SIZE);
-        disk.write(buffer, BLOCK_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        return logWrite(buffer, blockNum, 0, BLOCK_SIZE);
+    }
+
+    /**
+     * Updates the file data block with specified block number 
+     * with the contents in input byte buffer through the cache
+     * (file data is not journaled)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int updateDataBlock(char* buffer, int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        // block number out of range
+        if (blockNum < 0 || blockNum >= super.numBlocks) return 1;
+        // attempting to update a block that is free
+        if (freeBlocks.test(blockNum)) return 1;
+        // update the specified block 
+        STATS_COUNT(STAT_DATA_BLOCK_WRITES, 1);
+        return cache.write(buffer, blockNum, 0, BLOCK_SIZE);
     }
 
     /**
      * Frees the block with specified block number
+     * (a shared block only loses a reference)
      * 
      * Returns 0 on success and 1 on failure
      */
     int freeBlock(int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         // block number out of range
-        if (blockNum < 0 || blockNum >= NUM_BLOCKS) return 1;
+        if (blockNum < 0 || blockNum >= super.numBlocks) return 1;
         // attempting to write a block that is already free
-        if (freeBlocks[blockNum] == 1) return 1;
-        // update the block to free in vector then on free block
-        freeBlocks[blockNum] = 1;
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekg(BLOCK_SIZE + blockNum/8);
-        char byte[1];
-        disk.read(byte, 1);
-        byte[0] |= 1 << (7 - blockNum % 8);
-        disk.seekp(BLOCK_SIZE + blockNum/8);
-        disk.write(byte, 1);
-        if (disk.bad()) return 1;
-        disk.close();
+        if (freeBlocks.test(blockNum)) return 1;
+        // a shared block only loses a reference
+        if (blockShares[blockNum] > 0) changeShares(blockNum, -1);
+        else releaseBlocks(blockNum, 1); // update the block to free in the bitmap (written back on commit)
         return 0;
     }
 
     /**
-     * Returns the block number of the first free block
-     * utilizing a clock hand algorithm to avoid 
-     * repeatedly allocating the same blocks
+     * Frees count blocks starting from the specified block number
+     * (shared blocks only lose a reference)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int freeBlockRange(int startBlock, int count) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        // block range out of range
+        if (startBlock < super.dataStart || count < 0 || startBlock + count > super.numBlocks) return 1;
+        // attempting to free a block that is already free
+        if (!freeBlocks.testRange(startBlock, count, false)) return 1;
+        // free the runs of unshared blocks
+        int runStart = startBlock;
+        for (int blockNum = startBlock; blockNum <= startBlock + count; blockNum++) {
+            if (blockNum < startBlock + count && blockShares[blockNum] == 0) continue;
+            if (blockNum > runStart) releaseBlocks(runStart, blockNum - runStart);
+            if (blockNum < startBlock + count) changeShares(blockNum, -1);
+            runStart = blockNum + 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Adds a reference to the allocated block with specified block number
+     * (freeing it then only drops the reference)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int shareBlock(int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        // block number out of range
+        if (blockNum < super.dataStart || blockNum >= super.numBlocks) return 1;
+        // attempting to share a block that is free
+        if (freeBlocks.test(blockNum)) return 1;
+        // too many references to count
+        if (blockShares[blockNum] == MAX_BLOCK_SHARES) return 1;
+        changeShares(blockNum, 1);
+        return 0;
+    }
+
+    /**
+     * Returns the number of references to the block with specified block number
+     * (0 for a free block and more than 1 for a block shared by several files)
+     */
+    int getBlockRefCount(int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (blockNum < 0 || blockNum >= super.numBlocks || freeBlocks.test(blockNum)) return 0;
+        return blockShares[blockNum] + 1;
+    }
+
+    /**
+     * Returns read-only access to count contiguous allocated blocks starting
+     * from the specified block number until they are unpinned: the blocks
+     * in the mapping of the image if the backend maps it (writes to pinned
+     * blocks must go to copies and freeing them waits until they are unpinned)
+     * or a buffer of the pinned block pool filled with a single disk read
+     * 
+     * Returns nullptr on failure
+     */
+    const char* pinBlocks(int startBlock, int count) {
+        std::unique_ptr<char[]> buffer;
+        size_t size = count;
+        {
+            std::lock_guard<std::recursive_mutex> guard(driverLock);
+            // block range out of range
+            if (!disk || startBlock < 0 || count <= 0 || startBlock + count > super.numBlocks) return nullptr;
+            // attempting to pin a block that is free
+            if (!freeBlocks.testRange(startBlock, count, false)) return nullptr;
+            STATS_COUNT(STAT_BLOCKS_PINNED, count);
+            if (disk->data() != nullptr) {
+                for (int i = 0; i < count; i++) {
+                    if (blockPins[startBlock + i] == UINT16_MAX) { // too many pins to count
+                        unpin(startBlock, i);
+                        return nullptr;
+                    }
+                    blockPins[startBlock + i]++;
+                }
+                // cached blocks may be newer than the mapping
+                if (cache.writeBack(startBlock, count) != 0) {
+                    unpin(startBlock, count);
+                    return nullptr;
+                }
+                return disk->data() + (size_t) startBlock * BLOCK_SIZE;
+            }
+            // take the smallest idle buffer large enough from the pool
+            size_t best = idleBuffers.size();
+            for (size_t i = 0; i < idleBuffers.size(); i++) {
+                if (idleBuffers[i].first >= size && (best == idleBuffers.size() || idleBuffers[i].first < idleBuffers[best].first)) best = i;
+            }
+            if (best != idleBuffers.size()) {
+                size = idleBuffers[best].first;
+                buffer = std::move(idleBuffers[best].second);
+                idleBuffers.erase(idleBuffers.begin() + best);
+            }
+        }
+        if (!buffer) buffer.reset(new char[size * BLOCK_SIZE]);
+        if (readBlocks(buffer.get(), startBlock, count) != 0) return nullptr;
+        const char* data = buffer.get();
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        lentBuffers[data] = std::make_pair(size, std::move(buffer));
+        return data;
+    }
+
+    /**
+     * Releases count blocks starting from the specified block number
+     * pinned by pinBlocks, which returned data (freeing the blocks
+     * freed while they were pinned)
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int unpinBlocks(const char* data, int startBlock, int count) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (!disk || startBlock < 0 || count <= 0 || startBlock + count > super.numBlocks) return 1; // block range out of range
+        auto it = lentBuffers.find(data);
+        if (it == lentBuffers.end()) {
+            if (disk->data() + (size_t) startBlock * BLOCK_SIZE != data) return 1; // not pinned
+            unpin(startBlock, count);
+            return 0;
+        }
+        // keep the buffer for later pins while the pool is small
+        size_t idleBlocks = 0;
+        for (auto& idle : idleBuffers) idleBlocks += idle.first;
+        if (idleBlocks + it->second.first <= POOL_BLOCKS) idleBuffers.push_back(std::move(it->second));
+        lentBuffers.erase(it);
+        return 0;
+    }
+
+    /**
+     * Returns true if the block with specified block number is pinned
+     * in the mapping of the image (so it must not be written in place)
+     */
+    bool isPinned(int blockNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        return blockNum >= 0 && blockNum < (int) blockPins.size() && blockPins[blockNum] > 0;
+    }
+
+    /**
+     * Reads count contiguous blocks starting from the specified block number
+     * into a byte buffer with a single disk read
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int readBlocks(char* buffer, int startBlock, int count) {
+        {
+            std::lock_guard<std::recursive_mutex> guard(driverLock);
+            // block range out of range
+            if (startBlock < 0 || count < 0 || startBlock + count > super.numBlocks) return 1;
+            // attempting to read a block that is free
+            if (!freeBlocks.testRange(startBlock, count, false)) return 1;
+            // cached blocks may be newer than the disk
+            if (cache.writeBack(startBlock, count) != 0) return 1;
+        }
+        // the run is read outside the lock so reads of different files run in parallel
+        STATS_COUNT(STAT_DATA_BLOCKS_READ, count);
+        return disk->read(buffer, (size_t) count * BLOCK_SIZE, (size_t) startBlock * BLOCK_SIZE);
+    }
+
+    /**
+     * Updates count contiguous allocated blocks starting from the specified
+     * block number with the contents in input byte buffer with a single disk write
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int writeBlocks(char* buffer, int startBlock, int count) {
+        {
+            std::lock_guard<std::recursive_mutex> guard(driverLock);
+            // block range out of range
+            if (startBlock < 0 || count < 0 || startBlock + count > super.numBlocks) return 1;
+            // attempting to update a block that is free
+            if (!freeBlocks.testRange(startBlock, count, false)) return 1;
+            // drop cached copies so a stale dirty copy is never written back over the run
+            cache.discard(startBlock, count);
+        }
+        STATS_COUNT(STAT_DATA_BLOCKS_WRITTEN, count);
+        return disk->write(buffer, (size_t) count * BLOCK_SIZE, (size_t) startBlock * BLOCK_SIZE);
+    }
+
+    /**
+     * Allocates a run of up to maxCount contiguous free blocks
+     * as close after the goal block as possible within its allocation group
+     * (or after the clock hand of the group of the calling thread if the goal is -1)
+     * and stores the first block number in startBlock
+     *
+     * Without a long enough run there the emptiest other groups are searched
+     * 
+     * Returns the number of blocks allocated or 0 on failure (no free blocks were found)
+     */
+    int allocateBlocks(int goal, int maxCount, int& startBlock) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (maxCount <= 0 || groups.empty()) return 0;
+        int preferred = goal >= super.dataStart && goal < super.numBlocks ? groupOfBlock(goal) : homeGroup();
+        if (goal < super.dataStart || goal >= super.numBlocks) goal = groups[preferred].clock;
+        // take the first run after the goal long enough for the request
+        // or the longest run found if there is none
+        long bestStart = -1, bestLength = 0;
+        if (!findRun(groups[preferred], goal, maxCount, bestStart, bestLength)) {
+            vector<int> others;
+            for (int g = 0; g < (int) groups.size(); g++) {
+                if (g != preferred && groups[g].freeBlocks > bestLength) others.push_back(g);
+            }
+            std::sort(others.begin(), others.end(), [&](int a, int b) { return groups[a].freeBlocks > groups[b].freeBlocks; });
+            for (int g : others) {
+                if (findRun(groups[g], groups[g].clock, maxCount, bestStart, bestLength)) break;
+            }
+        }
+        if (bestStart == -1) return 0;
+        STATS_COUNT(STAT_BITMAP_UPDATES, 1);
+        if (groupOfBlock(bestStart) != preferred) STATS_COUNT(STAT_GROUP_STEALS, 1);
+        freeBlocks.clearRange(bestStart, bestLength);
+        markBitmapDirty(freeBlocksDirty, bestStart, bestLength);
+        countFreeBlocks(bestStart, bestLength, -1);
+        allocGroup& group = groups[groupOfBlock(bestStart)];
+        group.clock = bestStart + bestLength < group.endBlock ? bestStart + bestLength : group.firstBlock;
+        startBlock = bestStart;
+        return bestLength;
+    }
+
+    /**
+     * Returns the block number of a free block
+     * after the clock hand of the group of the calling thread
+     * (or of the emptiest other group if it is full)
      * 
      * Returns -1 on failure (no free blocks were found)
      */
     int getFreeBlock() {
-        for (int i = META_BLOCKS; i < NUM_BLOCKS; i++) {
-            if (freeBlocks[freeBlockClock + META_BLOCKS] == 1) {
-                int freeBlockNum = freeBlockClock + META_BLOCKS;
-                freeBlockClock = (freeBlockClock + 1) % (NUM_BLOCKS - META_BLOCKS);
-                return freeBlockNum;
-            }
-            freeBlockClock = (freeBlockClock + 1) % (NUM_BLOCKS - META_BLOCKS);
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (groups.empty()) return -1; // not mounted
+        long bestStart = -1, bestLength = 0;
+        allocGroup& home = groups[homeGroup()];
+        if (findRun(home, home.clock, 1, bestStart, bestLength)) return bestStart;
+        int emptiest = 0;
+        for (int g = 1; g < (int) groups.size(); g++) {
+            if (groups[g].freeBlocks > groups[emptiest].freeBlocks) emptiest = g;
         }
-        return -1;
+        findRun(groups[emptiest], groups[emptiest].clock, 1, bestStart, bestLength);
+        return bestStart;
     }
 
     /**
@@ -248,26 +1062,25 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int getRootInode(char* rootInode) {
-        disk.open(VDISK_FILE_NAME, ios::in | ios::binary);
-        disk.seekg(sizeof(superblock) - INODE_SIZE);
-        disk.read(rootInode, INODE_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (!disk) return 1; // not mounted
+        STATS_COUNT(STAT_INODE_READS, 1);
+        memcpy(rootInode, &inodeTable[0], INODE_SIZE);
         return 0;
     }
 
     /**
-     * Writes the root directory inode in the superblock from a given buffer
+     * Updates the root directory inode from a given buffer
+     * (written back to the superblock when the inodes are flushed)
      * 
      * Returns 0 on success and 1 on failure
      */
     int setRootInode(char* rootInode) {
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(sizeof(superblock) - INODE_SIZE);
-        disk.write(rootInode, INODE_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (!disk) return 1; // not mounted
+        STATS_COUNT(STAT_INODE_WRITES, 1);
+        memcpy(&inodeTable[0], rootInode, INODE_SIZE);
+        return markInodeDirty(-1);
     }
 
     /**
@@ -276,17 +1089,15 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int getInode(int inodeNum, char* inode) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         if (inodeNum == -1) return getRootInode(inode);
         // inode number out of range
-        if (inodeNum <= 0 || inodeNum > NUM_INODES) return 1;
+        if (inodeNum <= 0 || inodeNum > super.numInodes) return 1;
         // attempting to read a free inode
-        if (freeInodes[inodeNum] == 1) return 1;
-        // read the specified inode
-        disk.open(VDISK_FILE_NAME, ios::in | ios::binary);
-        disk.seekg(BLOCK_SIZE*2 + INODE_SIZE*(inodeNum-1));
-        disk.read(inode, INODE_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
+        if (freeInodes.test(inodeNum)) return 1;
+        // read the specified inode from the in-memory table
+        STATS_COUNT(STAT_INODE_READS, 1);
+        memcpy(inode, &inodeTable[inodeNum], INODE_SIZE);
         return 0;
     }
 
@@ -296,22 +1107,21 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int setInode(int inodeNum, char* inode) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         if (inodeNum == -1) return setRootInode(inode);
         // inode number out of range
-        if (inodeNum <= 0 || inodeNum > NUM_INODES) return 1;
+        if (inodeNum <= 0 || inodeNum > super.numInodes) return 1;
         // attempting to write an inode that is not free
-        if (freeInodes[inodeNum] == 0) return 1;
-        // write the specified inode to table
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(BLOCK_SIZE*2 + INODE_SIZE*(inodeNum-1));
-        disk.write(inode, INODE_SIZE);
-        // update the inode to not free in vector then in superblock
-        freeInodes[inodeNum] = 0;
-        disk.seekp(sizeof(superblock) - INODE_SIZE - NUM_INODES + inodeNum - 1);
-        disk.put(0);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        if (!freeInodes.test(inodeNum)) return 1;
+        // write the specified inode to the in-memory table
+        STATS_COUNT(STAT_INODE_WRITES, 1);
+        memcpy(&inodeTable[inodeNum], inode, INODE_SIZE);
+        // update the inode to not free in the bitmap (written back on commit)
+        STATS_COUNT(STAT_BITMAP_UPDATES, 1);
+        freeInodes.clear(inodeNum);
+        markBitmapDirty(freeInodesDirty, inodeNum, 1);
+        groups[groupOfInode(inodeNum)].freeInodes--;
+        return markInodeDirty(inodeNum);
     }
 
     /**
@@ -320,18 +1130,16 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int updateInode(int inodeNum, char* inode) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         if (inodeNum == -1) return setRootInode(inode);
         // inode number out of range
-        if (inodeNum <= 0 || inodeNum > NUM_INODES) return 1;
+        if (inodeNum <= 0 || inodeNum > super.numInodes) return 1;
         // attempting to update a free inode
-        if (freeInodes[inodeNum] == 1) return 1;
-        // update the specified inode in table
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(BLOCK_SIZE*2 + INODE_SIZE*(inodeNum-1));
-        disk.write(inode, INODE_SIZE);
-        if (disk.bad()) return 1;
-        disk.close();
-        return 0;
+        if (freeInodes.test(inodeNum)) return 1;
+        // update the specified inode in the in-memory table
+        STATS_COUNT(STAT_INODE_WRITES, 1);
+        memcpy(&inodeTable[inodeNum], inode, INODE_SIZE);
+        return markInodeDirty(inodeNum);
     }
 
     /**
@@ -340,32 +1148,82 @@ public:
      * Returns 0 on success and 1 on failure
      */
     int freeInode(int inodeNum) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
         // inode number out of range
-        if (inodeNum <= 0 || inodeNum > NUM_INODES) return 1;
+        if (inodeNum <= 0 || inodeNum > super.numInodes) return 1;
         // attempting to free an inode that is already free
-        if (freeInodes[inodeNum] == 1) return 1;
-        // update the inode to free in vector then in superblock
-        freeInodes[inodeNum] = 0;
-        disk.open(VDISK_FILE_NAME, ios::in | ios::out | ios::binary);
-        disk.seekp(sizeof(superblock) - INODE_SIZE - NUM_INODES + inodeNum - 1);
-        disk.put(1);
-        if (disk.bad()) return 1;
-        disk.close();
+        if (freeInodes.test(inodeNum)) return 1;
+        // update the inode to free in the bitmap (written back on commit)
+        STATS_COUNT(STAT_BITMAP_UPDATES, 1);
+        freeInodes.set(inodeNum);
+        markBitmapDirty(freeInodesDirty, inodeNum, 1);
+        groups[groupOfInode(inodeNum)].freeInodes++;
+        return 0;
+    }
+
+    /**
+     * Writes every block of the inode table holding a changed inode
+     * (and the root inode in the superblock if it changed) as a whole
+     * into the journal
+     * 
+     * Returns 0 on success and 1 on failure
+     */
+    int flushInodes() {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (!disk) return 1; // not mounted
+        if (dirtyInodes.test(0)) {
+            if (logWrite(reinterpret_cast<char*>(&inodeTable[0]), 0, offsetof(superblock, root), INODE_SIZE) != 0) return 1;
+            STATS_COUNT(STAT_INODE_BLOCKS_WRITTEN, 1);
+            dirtyInodes.clear(0);
+        }
+        long inodeNum = dirtyInodes.findSet(1, super.numInodes + 1);
+        while (inodeNum != -1) {
+            int first = (inodeNum - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK + 1; // first inode in the same block
+            int count = std::min(INODES_PER_BLOCK, super.numInodes - first + 1); // the last block may be partly used
+            if (logWrite(reinterpret_cast<char*>(&inodeTable[first]), super.inodeTableStart + (first - 1) / INODES_PER_BLOCK, 0, count * INODE_SIZE) != 0) return 1;
+            STATS_COUNT(STAT_INODE_BLOCKS_WRITTEN, 1);
+            dirtyInodes.clearRange(first, count);
+            inodeNum = dirtyInodes.findSet(first + INODES_PER_BLOCK, super.numInodes + 1);
+        }
+        lastInodeFlush = std::chrono::steady_clock::now();
         return 0;
     }
 
+    /**
+     * Sets how long changed inodes may stay only in memory
+     * before being flushed on the next change (0 to flush only on close and sync)
+     */
+    void setInodeFlushInterval(std::chrono::milliseconds interval) {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        inodeFlushInterval = interval;
+    }
+
+    /**
+     * Returns the block cache hit, miss and write back counters
+     */
+    cacheStats getCacheStats() {
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        return cache.getStats();
+    }
+
     /**
      * Returns the inode number of the first free inode
+     * of the group of the calling thread
+     * (or of the other group with the most free inodes if it has none)
      * 
      * Returns -1 on failure (no free inodes were found)
      */
     int getFreeInode() {
-        for (int i = 1; i <= NUM_INODES; i++) {
-            if (freeInodes[i] == 1) {
-                return i;
+        std::lock_guard<std::recursive_mutex> guard(driverLock);
+        if (groups.empty()) return -1; // not mounted
+        int preferred = homeGroup();
+        if (groups[preferred].freeInodes == 0) {
+            for (int g = 0; g < (int) groups.size(); g++) {
+                if (groups[g].freeInodes > groups[preferred].freeInodes) preferred = g;
             }
+            if (groups[preferred].freeInodes == 0) return -1;
         }
-        return -1;
+        return freeInodes.findSet(groups[preferred].firstInode, groups[preferred].endInode);
     }
 
 };